@@ -0,0 +1,99 @@
+#pragma once
+#include "photon_record.h"
+#include "photon_gather.h"
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+// Jensen's left-balanced kd-tree. The photons themselves are stored in heap
+// order (children of node i at 2i+1 and 2i+2) with the splitting axis in
+// Photon::flag, so the tree needs no pointers and no index permutation.
+class BalancedPhotonKDTree {
+    const Photon* photons = nullptr;
+    size_t count = 0;
+
+    // number of nodes in the left subtree of a left-balanced tree of n nodes
+    static size_t left_size(size_t n)
+    {
+        if (n <= 1) return 0;
+        int h = 0;
+        while ((size_t(2) << h) <= n) h++;
+        size_t full = (size_t(1) << h) - 1;
+        size_t last = n - full;
+        return (full - 1) / 2 + std::min(last, size_t(1) << (h - 1));
+    }
+    void balance(Photon* begin, Photon* end, PhotonBounds bounds, size_t node, Photon* heap)
+    {
+        if (begin == end) return;
+        // split along the largest extent of the subtree
+        int axis = 0;
+        for (int d = 1; d < 3; d++) {
+            if (bounds.hi[d] - bounds.lo[d] > bounds.hi[axis] - bounds.lo[axis]) axis = d;
+        }
+        Photon* median = begin + left_size(size_t(end - begin));
+        std::nth_element(begin, median, end, [axis](const Photon& a, const Photon& b) {
+            return a.pos[axis] < b.pos[axis];
+        });
+        heap[node] = *median;
+        heap[node].flag = uint16_t(axis);
+
+        PhotonBounds left = bounds, right = bounds;
+        left.hi[axis] = median->pos[axis];
+        right.lo[axis] = median->pos[axis];
+        balance(begin, median, left, 2 * node + 1, heap);
+        balance(median + 1, end, right, 2 * node + 2, heap);
+    }
+    template <class RESULTSET>
+    void locate(size_t node, const float q[3], RESULTSET& rs) const
+    {
+        const Photon& p = photons[node];
+        if (2 * node + 1 < count) {
+            float delta = q[p.flag] - p.pos[p.flag];
+            size_t near_child = delta < 0 ? 2 * node + 1 : 2 * node + 2;
+            size_t far_child = delta < 0 ? 2 * node + 2 : 2 * node + 1;
+            if (near_child < count) locate(near_child, q, rs);
+            if (far_child < count && delta * delta < rs.worstDist()) locate(far_child, q, rs);
+        }
+        float dx = p.pos[0] - q[0], dy = p.pos[1] - q[1], dz = p.pos[2] - q[2];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        if (d2 < rs.worstDist()) rs.addPoint(d2, node);
+    }
+public:
+    // reorder the photons in place into left-balanced heap order
+    void build(std::vector<Photon>& store, const PhotonBounds& bounds)
+    {
+        std::vector<Photon> scratch(store);
+        balance(scratch.data(), scratch.data() + scratch.size(), bounds, 0, store.data());
+        photons = store.data();
+        count = store.size();
+    }
+    // use photons that are already in heap order, e.g. a mapped photon cache
+    void attach(const Photon* heap, size_t n)
+    {
+        photons = heap;
+        count = n;
+    }
+    // n nearest photons closer than max_dist2, as indices into the heap-ordered store
+    void findNearestN(const float q[3], size_t n, PhotonGather& result,
+                      float max_dist2 = std::numeric_limits<float>::max()) const
+    {
+        result.reserve(n);
+        PhotonKNNHeap heap(n, max_dist2);
+        heap.init(result.indices.data(), result.dist2.data());
+        if (count > 0) locate(0, q, heap);
+        result.count = heap.size();
+        result.max_dist2 = result.count > 0 ? result.dist2[0] : 0.f;
+    }
+    // run any nanoflann-style result set over the tree
+    template <class RESULTSET>
+    void findNeighbors(RESULTSET& rs, const float q[3]) const
+    {
+        if (count > 0) locate(0, q, rs);
+    }
+    // every photon within radius of q
+    void findPhotonsWithinRadius(const float q[3], float radius, PhotonGather& result) const
+    {
+        PhotonRadiusSet rs(result, radius * radius);
+        if (count > 0) locate(0, q, rs);
+    }
+};
@@ -0,0 +1,42 @@
+#pragma once
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PHOTON_MAPPING_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// AVX2 kernels are compiled for AVX2 on their own, whatever the flags of the
+// rest of the target, and only called when the running CPU has AVX2. MSVC
+// accepts the intrinsics in any function and needs no attribute.
+#if defined(PHOTON_MAPPING_X86) && (defined(__GNUC__) || defined(__clang__))
+#define PHOTON_MAPPING_AVX2 __attribute__((target("avx2")))
+#else
+#define PHOTON_MAPPING_AVX2
+#endif
+
+inline bool detect_avx2()
+{
+#if defined(__AVX2__)
+    return true;
+#elif defined(PHOTON_MAPPING_X86) && defined(_MSC_VER) && !defined(__clang__)
+    // the CPU has AVX2 and the OS saves the YMM registers
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#elif defined(PHOTON_MAPPING_X86)
+    // this runs from a static initializer, possibly before libgcc's own
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+// checked once at startup, the kernels branch on it
+inline const bool c_cpu_avx2 = detect_avx2();
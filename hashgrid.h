@@ -0,0 +1,96 @@
+#pragma once
+#include "photon_record.h"
+#include "photon_gather.h"
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// spatial hash of an integer grid cell (Teschner et al.)
+inline size_t spatial_hash(int x, int y, int z)
+{
+    return size_t(uint32_t(x) * 73856093u) ^ size_t(uint32_t(y) * 19349663u) ^ size_t(uint32_t(z) * 83492791u);
+}
+
+// Uniform hash grid for fixed-radius and bounded gathers. The cell size equals the
+// gather radius, so a query visits at most the 27 cells around it. The
+// photons are sorted by cell in place and cell_start[h] .. cell_start[h+1]
+// is the range of photons hashed to bucket h.
+class PhotonHashGrid {
+    const Photon* photons = nullptr;
+    float lo[3] = {0, 0, 0};
+    float inv_cell_size = 1;
+    size_t mask = 0;
+    std::vector<uint32_t> cell_start;
+
+    size_t hash(int x, int y, int z) const
+    {
+        return spatial_hash(x, y, z) & mask;
+    }
+    int cell(float p, int d) const { return int(std::floor((p - lo[d]) * inv_cell_size)); }
+    size_t hash(const float p[3]) const { return hash(cell(p[0], 0), cell(p[1], 1), cell(p[2], 2)); }
+public:
+    // sort the photons in place by grid cell
+    void build(std::vector<Photon>& store, const PhotonBounds& bounds, float cell_size)
+    {
+        for (int d = 0; d < 3; d++) lo[d] = bounds.lo[d];
+        inv_cell_size = 1.f / cell_size;
+        size_t table_size = 1;
+        while (table_size < store.size()) table_size <<= 1;
+        mask = table_size - 1;
+
+        // counting sort by bucket
+        cell_start.assign(table_size + 1, 0);
+        std::vector<uint32_t> buckets(store.size());
+        for (size_t i = 0; i < store.size(); i++) {
+            buckets[i] = uint32_t(hash(store[i].pos));
+            cell_start[buckets[i] + 1]++;
+        }
+        for (size_t h = 0; h < table_size; h++) cell_start[h + 1] += cell_start[h];
+        std::vector<Photon> sorted(store.size());
+        std::vector<uint32_t> next(cell_start.begin(), cell_start.end() - 1);
+        for (size_t i = 0; i < store.size(); i++) sorted[next[buckets[i]]++] = store[i];
+        store.swap(sorted);
+        photons = store.data();
+    }
+    // photons within radius of q; the radius must not exceed the cell size
+    template <class RESULTSET>
+    void findNeighbors(RESULTSET& rs, const float q[3]) const
+    {
+        if (cell_start.empty()) return;
+        int c[3] = {cell(q[0], 0), cell(q[1], 1), cell(q[2], 2)};
+        // neighbouring cells can share a bucket, visit each bucket once
+        size_t visited[27];
+        int num_visited = 0;
+        for (int dz = -1; dz <= 1; dz++) for (int dy = -1; dy <= 1; dy++) for (int dx = -1; dx <= 1; dx++) {
+            size_t h = hash(c[0] + dx, c[1] + dy, c[2] + dz);
+            bool seen = false;
+            for (int i = 0; i < num_visited; i++) seen |= visited[i] == h;
+            if (seen) continue;
+            visited[num_visited++] = h;
+            for (uint32_t i = cell_start[h]; i < cell_start[h + 1]; i++) {
+                const Photon& p = photons[i];
+                float ex = p.pos[0] - q[0], ey = p.pos[1] - q[1], ez = p.pos[2] - q[2];
+                float d2 = ex * ex + ey * ey + ez * ez;
+                if (d2 < rs.worstDist()) rs.addPoint(d2, i);
+            }
+        }
+    }
+    // squared cell size, the widest distance a query can see
+    float cell_size2() const { return 1.f / (inv_cell_size * inv_cell_size); }
+    // n nearest photons closer than max_dist2, clamped to one cell
+    void findNearestN(const float q[3], size_t n, PhotonGather& result,
+                      float max_dist2 = std::numeric_limits<float>::max()) const
+    {
+        result.reserve(n);
+        PhotonKNNHeap heap(n, std::min(max_dist2, cell_size2()));
+        heap.init(result.indices.data(), result.dist2.data());
+        findNeighbors(heap, q);
+        result.count = heap.size();
+        result.max_dist2 = result.count > 0 ? result.dist2[0] : 0.f;
+    }
+    void findPhotonsWithinRadius(const float q[3], float radius, PhotonGather& result) const
+    {
+        PhotonRadiusSet rs(result, radius * radius);
+        findNeighbors(rs, q);
+    }
+};
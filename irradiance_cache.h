@@ -0,0 +1,169 @@
+#pragma once
+#include "lajolla.h"
+#include "vector.h"
+#include "spectrum.h"
+#include "photon_record.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+// Ward-style irradiance cache over an octree. A record is valid around its
+// position out to max_error * radius and is stored in every octree node
+// that its validity sphere overlaps, at the depth where the nodes are
+// about twice that size, so a lookup only visits the nodes on the path
+// to the query point. The root grows to enclose every validity sphere, so
+// a query outside it has no valid record. Lookups share the lock and
+// insertions take it exclusively, so the render threads fill the cache as
+// they go.
+class IrradianceCache {
+public:
+    struct Record {
+        Vector3 position;
+        Vector3 normal;
+        Real radius;
+        Spectrum irradiance;
+        Vector3 gradient[3];    // translational gradient of each channel
+    };
+
+    void init(const PhotonBounds& bounds, Real error)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        max_error = error;
+        records.clear();
+        nodes.clear();
+        Real size = 0;
+        for (int d = 0; d < 3; d++) size = std::max(size, Real(bounds.hi[d] - bounds.lo[d]));
+        size *= Real(1.01);
+        Vector3 center{(bounds.lo[0] + bounds.hi[0]) / Real(2), (bounds.lo[1] + bounds.hi[1]) / Real(2),
+                       (bounds.lo[2] + bounds.hi[2]) / Real(2)};
+        nodes.push_back(Node{center - Vector3{size, size, size} / Real(2), size});
+    }
+
+    // weighted extrapolation of the records valid at p with normal n;
+    // false when none is
+    bool lookup(const Vector3& p, const Vector3& n, Spectrum& irradiance) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        Spectrum sum = make_zero_spectrum();
+        Real weight_sum = 0;
+        int node = 0;
+        while (node >= 0 && contains(nodes[node], p)) {
+            for (uint32_t r : nodes[node].records) {
+                const Record& record = records[r];
+                Real cos_n = dot(n, record.normal);
+                if (cos_n <= 0) continue;
+                Vector3 d = p - record.position;
+                // records behind the query point see a different surface
+                if (dot(d, (n + record.normal) / Real(2)) < -Real(0.05) * record.radius) continue;
+                Real denominator = length(d) / record.radius + sqrt(std::max(Real(1) - cos_n, Real(0)));
+                Real weight = Real(1) / std::max(denominator, Real(1e-6));
+                if (weight <= Real(1) / max_error) continue;
+                Spectrum e = record.irradiance + Spectrum{dot(record.gradient[0], d), dot(record.gradient[1], d),
+                                                          dot(record.gradient[2], d)};
+                sum += weight * max(e, make_zero_spectrum());
+                weight_sum += weight;
+            }
+            node = nodes[node].children[child_index(nodes[node], p)];
+        }
+        if (weight_sum <= 0) return false;
+        irradiance = sum / weight_sum;
+        return true;
+    }
+
+    void insert(const Record& record)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        uint32_t r = uint32_t(records.size());
+        records.push_back(record);
+        Real reach = max_error * record.radius;
+        grow(record.position, reach);
+        insert(0, 0, record.position, reach, r);
+    }
+
+private:
+    static constexpr int max_depth = 20;
+    static constexpr int max_growth = 32;
+    struct Node {
+        Vector3 lo;
+        Real size;
+        int children[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+        std::vector<uint32_t> records;
+    };
+    std::vector<Node> nodes;
+    std::vector<Record> records;
+    Real max_error = 0;
+    mutable std::shared_mutex mutex;
+
+    static bool contains(const Node& node, const Vector3& p)
+    {
+        for (int d = 0; d < 3; d++) {
+            if (p[d] < node.lo[d] || p[d] > node.lo[d] + node.size) return false;
+        }
+        return true;
+    }
+    static int child_index(const Node& node, const Vector3& p)
+    {
+        Real half = node.size / 2;
+        return (p.x > node.lo.x + half ? 1 : 0) | (p.y > node.lo.y + half ? 2 : 0) | (p.z > node.lo.z + half ? 4 : 0);
+    }
+    // distance from p to the cube of a node
+    static Real distance_to(const Vector3& lo, Real size, const Vector3& p)
+    {
+        Real d2 = 0;
+        for (int d = 0; d < 3; d++) {
+            Real e = std::max({lo[d] - p[d], Real(0), p[d] - (lo[d] + size)});
+            d2 += e * e;
+        }
+        return sqrt(d2);
+    }
+    static bool encloses(const Node& node, const Vector3& p, Real reach)
+    {
+        for (int d = 0; d < 3; d++) {
+            if (p[d] - reach < node.lo[d] || p[d] + reach > node.lo[d] + node.size) return false;
+        }
+        return true;
+    }
+    // double the root towards p until it holds the sphere of radius reach
+    // around p. the old root becomes one octant of the new one and hands it
+    // its records, which may reach beyond that octant
+    void grow(const Vector3& p, Real reach)
+    {
+        for (int i = 0; i < max_growth && !encloses(nodes[0], p, reach); i++) {
+            Node old_root = std::move(nodes[0]);
+            Vector3 lo = old_root.lo;
+            int octant = 0;
+            for (int d = 0; d < 3; d++) {
+                if (p[d] - reach < old_root.lo[d]) {
+                    lo[d] -= old_root.size;
+                    octant |= 1 << d;
+                }
+            }
+            nodes[0] = Node{lo, 2 * old_root.size};
+            nodes[0].records = std::move(old_root.records);
+            old_root.records.clear();
+            nodes[0].children[octant] = int(nodes.size());
+            nodes.push_back(std::move(old_root));
+        }
+    }
+    void insert(int node, int depth, const Vector3& p, Real reach, uint32_t r)
+    {
+        Real half = nodes[node].size / 2;
+        if (depth == max_depth || half < 2 * reach) {
+            nodes[node].records.push_back(r);
+            return;
+        }
+        for (int c = 0; c < 8; c++) {
+            Vector3 lo = nodes[node].lo + Vector3{(c & 1) ? half : 0, (c & 2) ? half : 0, (c & 4) ? half : 0};
+            if (distance_to(lo, half, p) > reach) continue;
+            if (nodes[node].children[c] < 0) {
+                int child = int(nodes.size());
+                nodes.push_back(Node{lo, half});     // may reallocate, index again below
+                nodes[node].children[c] = child;
+            }
+            insert(nodes[node].children[c], depth + 1, p, reach, r);
+        }
+    }
+};
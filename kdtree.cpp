@@ -1,58 +1,231 @@
 #pragma once
 #include "nanoflann.hpp"
 #include "vector.h"
+#include "photon_record.h"
+#include "photon_gather.h"
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <stdexcept>
+#include <vector>
 using namespace nanoflann;
 
-struct PointCloud {
-    struct P { float x, y, z; };
-    std::vector<P> pts;
-    size_t kdtree_get_point_count() const { return pts.size(); }
-    float  kdtree_get_pt(size_t idx, size_t dim) const
+// nanoflann dataset adaptor reading positions straight from the photon store
+struct PhotonCloud {
+    const Photon* photons = nullptr;
+    size_t count = 0;
+    PhotonBounds bounds;
+    size_t kdtree_get_point_count() const { return count; }
+    float  kdtree_get_pt(size_t idx, size_t dim) const { return photons[idx].pos[dim]; }
+    template<class BBOX> bool kdtree_get_bbox(BBOX& bb) const
     {
-        return dim == 0 ? pts[idx].x : dim == 1 ? pts[idx].y : pts[idx].z;
+        for (int d = 0; d < 3; d++) {
+            bb[d].low = bounds.lo[d];
+            bb[d].high = bounds.hi[d];
+        }
+        return true;
     }
-    template<class BBOX> bool kdtree_get_bbox(BBOX&) const { return false; }
 };
 
-using KDTree = nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<float, PointCloud>,PointCloud,3,  size_t >;
+using KDTree = nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<float, PhotonCloud>,PhotonCloud,3,  size_t >;
+using DynamicKDTree = nanoflann::KDTreeSingleIndexDynamicAdaptor<nanoflann::L2_Simple_Adaptor<float, PhotonCloud>, PhotonCloud, 3, size_t>;
+
+// ---------- wrapper classes ----------
+// queries over a nanoflann index
+template <class INDEX>
+class NanoflannPhotonIndex {
+protected:
+    PhotonCloud cloud;
+    std::unique_ptr<INDEX> kd_tree;
 
-// ---------- wrapper class ----------
+    void point_at(const Photon* photons, size_t count, const PhotonBounds& bounds)
+    {
+        cloud.photons = photons;
+        cloud.count = count;
+        cloud.bounds = bounds;
+    }
+public:
+    // query
+    // n nearest photons closer than max_dist2 into the caller's scratch
+    void findNearestN(const float q[3], size_t n, PhotonGather& result,
+                      float max_dist2 = std::numeric_limits<float>::max()) const
+    {
+        result.reserve(n);
+        PhotonKNNHeap rs(n, max_dist2);
+        rs.init(result.indices.data(), result.dist2.data());
+        kd_tree->findNeighbors(rs, q, nanoflann::SearchParameters(0, false));
+        result.count = rs.size();
+        result.max_dist2 = result.count > 0 ? result.dist2[0] : 0.f;
+    }
+    // run any nanoflann result set over the index
+    template <class RESULTSET>
+    void findNeighbors(RESULTSET& rs, const float q[3]) const
+    {
+        kd_tree->findNeighbors(rs, q, nanoflann::SearchParameters(0, false));
+    }
+    // every photon within radius of q
+    void findPhotonsWithinRadius(const float q[3], float radius, PhotonGather& result) const
+    {
+        PhotonRadiusSet rs(result, radius * radius);
+        kd_tree->findNeighbors(rs, q, nanoflann::SearchParameters());
+    }
+};
+
+// node of a kd-tree flattened into one array in depth-first order. nodes
+// refer to each other and to the photons by index only, so the array can
+// be written to a file and searched in place from a read-only mapping.
+struct FlatKDNode {
+    uint32_t child1, child2;    // node indices, both 0 for a leaf (node 0 is the root)
+    uint32_t first, last;       // leaf: range of the order array; inner: split axis in first
+    float low, high;            // inner: nanoflann's divlow / divhigh
+};
+static_assert(sizeof(FlatKDNode) == 24, "FlatKDNode is stored in photon cache files");
+
+// nanoflann builds the tree, which is then flattened and searched with the
+// same traversal as nanoflann's searchLevel, so results are unchanged.
 class PhotonKDTree {
-    PointCloud cloud;
-    std::unique_ptr<KDTree> kd_tree; 
+    const Photon* photons = nullptr;
+    PhotonBounds bounds;
+    std::vector<FlatKDNode> node_store;
+    std::vector<uint32_t> order_store;
+    const FlatKDNode* nodes = nullptr;  // node_store, or a mapped photon cache
+    const uint32_t* order = nullptr;    // photon index of each leaf slot
+    size_t num_nodes = 0;
+
+    template <class NODE>
+    uint32_t flatten(const NODE* node)
+    {
+        uint32_t index = uint32_t(node_store.size());
+        node_store.push_back(FlatKDNode{});
+        if (node->child1 == nullptr && node->child2 == nullptr) {
+            node_store[index].first = uint32_t(node->node_type.lr.left);
+            node_store[index].last = uint32_t(node->node_type.lr.right);
+            return index;
+        }
+        node_store[index].first = uint32_t(node->node_type.sub.divfeat);
+        node_store[index].low = node->node_type.sub.divlow;
+        node_store[index].high = node->node_type.sub.divhigh;
+        uint32_t child1 = flatten(node->child1);
+        uint32_t child2 = flatten(node->child2);
+        node_store[index].child1 = child1;     // node_store may have grown
+        node_store[index].child2 = child2;
+        return index;
+    }
+    template <class RESULTSET>
+    bool search(RESULTSET& rs, const float q[3], uint32_t index, float mindist, float dists[3]) const
+    {
+        const FlatKDNode& node = nodes[index];
+        if (node.child1 == 0 && node.child2 == 0) {
+            float worst_dist = rs.worstDist();
+            for (uint32_t i = node.first; i < node.last; i++) {
+                const Photon& p = photons[order[i]];
+                float dx = q[0] - p.pos[0], dy = q[1] - p.pos[1], dz = q[2] - p.pos[2];
+                float dist = dx * dx + dy * dy + dz * dz;
+                if (dist < worst_dist && !rs.addPoint(dist, order[i])) return false;
+            }
+            return true;
+        }
+        uint32_t axis = node.first;
+        float val = q[axis];
+        float diff1 = val - node.low, diff2 = val - node.high;
+        uint32_t best = node.child2, other = node.child1;
+        float cut_dist = (val - node.low) * (val - node.low);
+        if (diff1 + diff2 < 0) {
+            best = node.child1;
+            other = node.child2;
+            cut_dist = (val - node.high) * (val - node.high);
+        }
+        if (!search(rs, q, best, mindist, dists)) return false;
+        float dst = dists[axis];
+        mindist = mindist + cut_dist - dst;
+        dists[axis] = cut_dist;
+        if (mindist <= rs.worstDist() && !search(rs, q, other, mindist, dists)) return false;
+        dists[axis] = dst;
+        return true;
+    }
 public:
-    // fill cloud & build index
-    void build(const std::vector<Vector3>& pos)
+    // run any nanoflann-style result set over the tree
+    template <class RESULTSET>
+    void findNeighbors(RESULTSET& rs, const float q[3]) const
     {
-        for (const Vector3& p: pos) {
-            PointCloud::P xyz = { p.x, p.y, p.z };
-            cloud.pts.push_back(xyz);
+        if (num_nodes == 0) return;
+        float dists[3] = {0.f, 0.f, 0.f};
+        float mindist = 0.f;
+        for (int d = 0; d < 3; d++) {
+            if (q[d] < bounds.lo[d]) dists[d] = (q[d] - bounds.lo[d]) * (q[d] - bounds.lo[d]);
+            if (q[d] > bounds.hi[d]) dists[d] = (q[d] - bounds.hi[d]) * (q[d] - bounds.hi[d]);
+            mindist += dists[d];
         }
-        kd_tree = std::make_unique<KDTree>(3, cloud, nanoflann::KDTreeSingleIndexAdaptorParams(10));
-        kd_tree->buildIndex();
+        search(rs, q, 0, mindist, dists);
     }
-    // query
-    std::vector<size_t> findNearestN(const float q[3], size_t n, float& max_dist2) const
+    // build the index on all cores over the photons, which must not be
+    // reallocated while the index is in use
+    void build(const std::vector<Photon>& store, const PhotonBounds& store_bounds)
     {
-        std::vector<size_t> indices(n);
-        std::vector<float>   distances(n); 
-        nanoflann::KNNResultSet<float> rs(n);
-        rs.init(indices.data(), distances.data());
-        kd_tree->findNeighbors(rs, q, nanoflann::SearchParameters());
-        max_dist2 = *std::max_element(distances.begin(), distances.end());
-        return indices;
-    }
-    std::vector<size_t> findPhotonsWithinRadius(const float q[3], float radius) const {
-        std::vector<nanoflann::ResultItem<size_t, float>> matches;
-        nanoflann::SearchParameters params;
-        kd_tree->radiusSearch(q, radius, matches, params);
-        std::vector<size_t> indices;
-        indices.reserve(matches.size());
-        for (const auto& match : matches) {
-            indices.push_back(match.first);
+        if (store.size() > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("too many photons for the kd-tree index");
+        PhotonCloud cloud{store.data(), store.size(), store_bounds};
+        node_store.clear();
+        order_store.clear();
+        if (!store.empty()) {
+            nanoflann::KDTreeSingleIndexAdaptorParams params(10, nanoflann::KDTreeSingleIndexAdaptorFlags::None, 0);
+            KDTree tree(3, cloud, params);
+            flatten(tree.root_node_);
+            order_store.assign(tree.vAcc_.begin(), tree.vAcc_.end());
         }
+        attach(store.data(), store_bounds, node_store.data(), node_store.size(), order_store.data());
+    }
+    // search a flattened tree kept elsewhere, e.g. in a mapped photon cache
+    void attach(const Photon* photon_data, const PhotonBounds& photon_bounds,
+                const FlatKDNode* node_data, size_t node_count, const uint32_t* order_data)
+    {
+        photons = photon_data;
+        bounds = photon_bounds;
+        nodes = node_data;
+        num_nodes = node_count;
+        order = order_data;
+    }
+    const FlatKDNode* node_data() const { return nodes; }
+    size_t node_count() const { return num_nodes; }
+    const uint32_t* order_data() const { return order; }
+
+    // query
+    // n nearest photons closer than max_dist2 into the caller's scratch
+    void findNearestN(const float q[3], size_t n, PhotonGather& result,
+                      float max_dist2 = std::numeric_limits<float>::max()) const
+    {
+        result.reserve(n);
+        PhotonKNNHeap rs(n, max_dist2);
+        rs.init(result.indices.data(), result.dist2.data());
+        findNeighbors(rs, q);
+        result.count = rs.size();
+        result.max_dist2 = result.count > 0 ? result.dist2[0] : 0.f;
+    }
+    // every photon within radius of q
+    void findPhotonsWithinRadius(const float q[3], float radius, PhotonGather& result) const
+    {
+        PhotonRadiusSet rs(result, radius * radius);
+        findNeighbors(rs, q);
+    }
+};
 
-        return indices;
+// nanoflann's logarithmic forest of static trees: appending m photons
+// rebuilds only the trees they merge into, O(m log n) amortised, so the
+// photon map can grow without a full rebuild. photons are never reordered.
+class DynamicPhotonKDTree : public NanoflannPhotonIndex<DynamicKDTree> {
+public:
+    void build(const std::vector<Photon>& photons, const PhotonBounds& bounds)
+    {
+        point_at(photons.data(), photons.size(), bounds);
+        nanoflann::KDTreeSingleIndexAdaptorParams params(10, nanoflann::KDTreeSingleIndexAdaptorFlags::None, 0);
+        kd_tree = std::make_unique<DynamicKDTree>(3, cloud, params);
+    }
+    // index the photons added to the store since the last build or append.
+    // the store may have been reallocated, the adaptor is pointed at it again
+    void append(const std::vector<Photon>& photons, const PhotonBounds& bounds)
+    {
+        size_t first = cloud.count;
+        point_at(photons.data(), photons.size(), bounds);
+        if (photons.size() > first) kd_tree->addPoints(first, photons.size() - 1);
     }
 };
@@ -7,6 +7,7 @@
 #include "progress_reporter.h"
 #include "pcg.h"
 #include "photon.h"
+#include "progressive.h"
 #include <embree4/rtcore.h>
 #include <memory>
 #include <thread>
@@ -16,21 +17,25 @@
 extern template float  next_pcg32_real<float >(pcg32_state&);
 extern template double next_pcg32_real<double>(pcg32_state&);
 
-Image3 pm_render(const Scene &scene) {
+Image3 pm_render(const Scene &scene, const PhotonMappingOptions &options) {
     //initialize
-    const int n_photons = 1000000;
-    const int n_neighbors = 500;
-    const int max_depth = 10;
     const int w = scene.camera.width, 
-    const h = scene.camera.height;
+              h = scene.camera.height;
     Image3 img(w, h);
-    PhotonMapping pm(n_photons, scene, n_neighbors, max_depth);
+    PhotonMapping pm(scene, options);
     
-    //photon tracing
-    pcg32_state rng = init_pcg32();
-    pm.photon_tracing(rng);
-    //create kdtree
-    pm.build_kdtree();
+    //photon tracing, skipped when a cached photon map matches
+    if (!pm.load_cache()) {
+        pm.photon_tracing();
+        pm.sort_photons();
+        //create kdtree
+        pm.build_kdtree();
+        pm.save_cache();
+    }
+    pm.precompute_radiance();
+    //with add_photons, that many more photon paths are appended to the
+    //dynamic index, without a rebuild, before the image is rendered
+    if (options.add_photons > 0) pm.add_photons(options.add_photons);
 
     //Camera-Ray Tracing
     constexpr int tile_size = 16;
@@ -43,10 +48,35 @@ Image3 pm_render(const Scene &scene) {
         int x1 = min(x0 + tile_size, w);
         int y0 = tile[1] * tile_size;
         int y1 = min(y0 + tile_size, h);
+        int spp = scene.options.samples_per_pixel;
+        if (options.camera_gather != CameraGather::PerSample) {
+            // first hits of the whole tile, then the gathers in Z-order
+            std::vector<CameraHit> hits;
+            hits.reserve((x1 - x0) * (y1 - y0) * spp);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    for (int s = 0; s < spp; s++) {
+                        hits.push_back(pm.camera_hit(x, y, rng));
+                    }
+                }
+            }
+            pm.gather_hits(hits, rng);
+            size_t i = 0;
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    Spectrum radiance = make_zero_spectrum();
+                    for (int s = 0; s < spp; s++) {
+                        radiance += hits[i++].radiance;
+                    }
+                    img(x, y) = radiance / Real(spp);
+                }
+            }
+            reporter.update(1);
+            return;
+        }
         for (int y = y0; y < y1; y++) {
             for (int x = x0; x < x1; x++) {
                 Spectrum radiance = make_zero_spectrum();
-                int spp = scene.options.samples_per_pixel;
                 for (int s = 0; s < spp; s++) {
                     radiance += pm.camera_tracing(x, y, rng);
                 }
@@ -64,7 +94,14 @@ int main(int argc, char *argv[]) {
 
     if (argc <= 1) {
         std::cout << "[Usage] ./lajolla [-t num_threads] [-o output_file_name] \
-                      [-r is_path_tracing]  filename.xml" << std::endl;
+                      [-r is_path_tracing] [-tracer scalar|wavefront] \
+                      [-index nanoflann|balanced|hashgrid|simd|dynamic] \
+                      [-gather knn|radius|bounded] [-radius gather_radius] \
+                      [-morton is_morton_sort] [-camera persample|sorted|prefetch] \
+                      [-hint is_radius_hint] [-radiance radiance_stride] \
+                      [-icache irradiance_error] [-fg final_gather_rays] \
+                      [-ppm num_passes] [-sppm num_passes] [-alpha ppm_alpha] \
+                      [-pipeline is_pipelined] [-cache photon_cache_file] [-add num_added_photons]  filename.xml" << std::endl;
         return 0;
     }
 
@@ -72,6 +109,7 @@ int main(int argc, char *argv[]) {
     std::string outputfile = "";
     std::vector<std::string> filenames;
     bool is_path_traing = false;
+    PhotonMappingOptions pm_options;
     for (int i = 1; i < argc; ++i) {
         if (std::string(argv[i]) == "-t") {
             num_threads = std::stoi(std::string(argv[++i]));
@@ -80,6 +118,48 @@ int main(int argc, char *argv[]) {
         } 
         else if (std::string(argv[i]) == "-r") {
             is_path_traing = bool(argv[++i]);
+        } else if (std::string(argv[i]) == "-tracer") {
+            std::string tracer = std::string(argv[++i]);
+            pm_options.tracer = tracer == "wavefront" ? PhotonTracer::Wavefront : PhotonTracer::Scalar;
+        } else if (std::string(argv[i]) == "-index") {
+            std::string index = std::string(argv[++i]);
+            pm_options.index = index == "balanced" ? PhotonIndex::Balanced :
+                               index == "hashgrid" ? PhotonIndex::HashGrid :
+                               index == "simd" ? PhotonIndex::Simd :
+                               index == "dynamic" ? PhotonIndex::Dynamic : PhotonIndex::NanoFlann;
+        } else if (std::string(argv[i]) == "-gather") {
+            std::string gather = std::string(argv[++i]);
+            pm_options.gather = gather == "radius" ? GatherMode::Radius :
+                                gather == "bounded" ? GatherMode::Bounded : GatherMode::KNearest;
+        } else if (std::string(argv[i]) == "-radius") {
+            pm_options.gather_radius = std::stof(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-morton") {
+            pm_options.morton_sort = std::stoi(std::string(argv[++i])) != 0;
+        } else if (std::string(argv[i]) == "-camera") {
+            std::string camera = std::string(argv[++i]);
+            pm_options.camera_gather = camera == "sorted" ? CameraGather::Sorted :
+                                       camera == "prefetch" ? CameraGather::Prefetch : CameraGather::PerSample;
+        } else if (std::string(argv[i]) == "-hint") {
+            pm_options.radius_hint = std::stoi(std::string(argv[++i])) != 0;
+        } else if (std::string(argv[i]) == "-radiance") {
+            pm_options.radiance_stride = std::stoi(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-icache") {
+            pm_options.irradiance_error = std::stof(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-fg") {
+            pm_options.final_gather_rays = std::stoi(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-ppm") {
+            pm_options.passes = std::stoi(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-sppm") {
+            pm_options.passes = std::stoi(std::string(argv[++i]));
+            pm_options.stochastic = true;
+        } else if (std::string(argv[i]) == "-pipeline") {
+            pm_options.pipeline = std::stoi(std::string(argv[++i])) != 0;
+        } else if (std::string(argv[i]) == "-alpha") {
+            pm_options.alpha = std::stof(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-add") {
+            pm_options.add_photons = std::stoi(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-cache") {
+            pm_options.cache_file = std::string(argv[++i]);
         }else {
             filenames.push_back(std::string(argv[i]));
         }
@@ -94,13 +174,17 @@ int main(int argc, char *argv[]) {
         std::cout << "Parsing and constructing scene " << filename << "." << std::endl;
         std::unique_ptr<Scene> scene = parse_scene(filename, embree_device);
         std::cout << "Done. Took " << tick(timer) << " seconds." << std::endl;
+        if (!pm_options.cache_file.empty()) pm_options.scene_hash = hash_scene(filename, *scene);
         std::cout << "Rendering..." << std::endl;
         Image3 img;
         if(is_path_traing){
             img = render(*scene);
         }
+        else if (pm_options.passes > 0) {
+            img = pm_options.stochastic ? sppm_render(*scene, pm_options) : ppm_render(*scene, pm_options);
+        }
         else{
-            img = pm_render(*scene);
+            img = pm_render(*scene, pm_options);
         }
         if (outputfile.compare("") == 0) {outputfile = scene->output_filename;}
         std::cout << "Done. Took " << tick(timer) << " seconds." << std::endl;
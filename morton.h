@@ -0,0 +1,42 @@
+#pragma once
+#include "photon_record.h"
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// spread the low 21 bits of v so that there are two zero bits between each
+inline uint64_t expand_bits_21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+// 63-bit Z-order code of a point, quantized to 2^21 steps inside bounds
+inline uint64_t morton_code(const float p[3], const PhotonBounds& bounds) {
+    uint64_t code = 0;
+    for (int d = 0; d < 3; d++) {
+        float extent = bounds.hi[d] - bounds.lo[d];
+        float t = extent > 0 ? (p[d] - bounds.lo[d]) / extent : 0.f;
+        uint64_t q = uint64_t(std::clamp(t, 0.f, 1.f) * float((1 << 21) - 1));
+        code |= expand_bits_21(q) << d;
+    }
+    return code;
+}
+
+// reorder photons along the Z-order curve so that photons close in space
+// are also close in memory
+inline void sort_photons_morton(std::vector<Photon>& photons, const PhotonBounds& bounds) {
+    std::vector<std::pair<uint64_t, uint32_t>> keys(photons.size());
+    for (size_t i = 0; i < photons.size(); i++) {
+        keys[i] = {morton_code(photons[i].pos, bounds), uint32_t(i)};
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<Photon> sorted(photons.size());
+    for (size_t i = 0; i < keys.size(); i++) sorted[i] = photons[keys[i].second];
+    photons.swap(sorted);
+}
@@ -1,18 +1,345 @@
 #pragma once  
 #include "photon.h"
-
-PhotonMapping::PhotonMapping(const int num_photons, const Scene& scene, const int n_neighbors, const int max_depth) 
-: num_photons(num_photons), scene(scene), n_neighbors(n_neighbors), max_depth(max_depth){
+#include <cstring>
+#include <iostream>
+
+PhotonMapping::PhotonMapping(const Scene& scene, const PhotonMappingOptions& options) 
+: options(options), scene(scene){
+    if (options.index == PhotonIndex::HashGrid && options.gather == GatherMode::KNearest)
+        throw std::runtime_error("the hash grid photon index only supports radius and bounded gathers");
+    if (options.add_photons > 0 && options.index != PhotonIndex::Dynamic)
+        throw std::runtime_error("appending photons needs the dynamic photon index");
 }
 PhotonMapping::~PhotonMapping(){
 }
-void PhotonMapping::build_kdtree() {kdtree.build(photon_pos); }
-void PhotonMapping::store_photon(Vector3 position, 
-                                 Vector3 direction, 
-                                 Spectrum energy) {
-    Photon p{position, direction, energy};
-    photon_map.push_back(p);
-    photon_pos.push_back(position);
+void PhotonMapping::sort_photons() {
+    // the other indices impose their own photon order
+    if (!options.morton_sort) return;
+    if (options.index != PhotonIndex::NanoFlann && options.index != PhotonIndex::Dynamic) return;
+    sort_photons_morton(photon_map, photon_bounds);
+}
+void PhotonMapping::build_kdtree() {
+    gather_radius = options.gather_radius;
+    if (gather_radius <= 0) {
+        float dx = photon_bounds.hi[0] - photon_bounds.lo[0];
+        float dy = photon_bounds.hi[1] - photon_bounds.lo[1];
+        float dz = photon_bounds.hi[2] - photon_bounds.lo[2];
+        gather_radius = 0.01f * std::sqrt(dx * dx + dy * dy + dz * dz);
+    }
+    switch (options.index) {
+        case PhotonIndex::Balanced: balanced_kdtree.build(photon_map, photon_bounds); break;
+        case PhotonIndex::HashGrid: hashgrid.build(photon_map, photon_bounds, gather_radius); break;
+        case PhotonIndex::Simd: simd_kdtree.build(photon_map); break;
+        case PhotonIndex::Dynamic: dynamic_kdtree.build(photon_map, photon_bounds); break;
+        default: kdtree.build(photon_map, photon_bounds); break;
+    }
+    photon_records = photon_map.data();
+    if (options.irradiance_error > 0) irradiance_cache.init(photon_bounds, options.irradiance_error);
+}
+uint64_t PhotonMapping::cache_key() const {
+    // every option that changes the traced photons or the order they are stored in
+    int32_t params[] = {options.num_photons, options.max_depth, int32_t(options.tracer), int32_t(options.index),
+                        int32_t(options.morton_sort), options.radiance_stride, int32_t(sizeof(Photon))};
+    uint64_t h = fnv1a(&c_photon_seed, sizeof(c_photon_seed));
+    h = fnv1a(params, sizeof(params), h);
+    return fnv1a(&options.gather_radius, sizeof(options.gather_radius), h);
+}
+bool PhotonMapping::load_cache() {
+    // replaces photon_tracing, sort_photons and build_kdtree when the cache
+    // file was written for this scene and these options; otherwise the
+    // photons are traced again and save_cache overwrites the file
+    if (options.cache_file.empty() || !cache_map.open(options.cache_file)) return false;
+    const char* data = cache_map.data();
+    size_t size = cache_map.size();
+    const PhotonCacheHeader* header = reinterpret_cast<const PhotonCacheHeader*>(data);
+    if (size < sizeof(PhotonCacheHeader) || std::memcmp(header->magic, c_photon_cache_magic, 8) != 0 ||
+        header->version != c_photon_cache_version || header->index != uint32_t(options.index) ||
+        header->scene_hash != options.scene_hash || header->params_hash != cache_key() ||
+        header->num_photons == 0 ||
+        header->photon_offset + header->num_photons * sizeof(Photon) > size ||
+        header->site_offset + header->num_sites * sizeof(Photon) > size ||
+        header->node_offset + header->num_nodes * sizeof(FlatKDNode) > size ||
+        header->order_offset + (header->num_nodes > 0 ? header->num_photons : 0) * sizeof(uint32_t) > size ||
+        (options.index == PhotonIndex::NanoFlann && header->num_nodes == 0)) {
+        cache_map.close();
+        return false;
+    }
+    const Photon* stored = reinterpret_cast<const Photon*>(data + header->photon_offset);
+    const Photon* sites = reinterpret_cast<const Photon*>(data + header->site_offset);
+    size_t count = size_t(header->num_photons);
+    num_emitted = int64_t(header->num_emitted);
+    next_photon = num_emitted;
+    photon_bounds = header->bounds;
+    radiance_map.assign(sites, sites + header->num_sites);
+    switch (options.index) {
+        case PhotonIndex::Balanced:
+            // stored in heap order, queried straight from the mapped pages
+            balanced_kdtree.attach(stored, count);
+            break;
+        case PhotonIndex::NanoFlann:
+            // the flattened nodes and leaf order are searched in place as well
+            kdtree.attach(stored, photon_bounds, reinterpret_cast<const FlatKDNode*>(data + header->node_offset),
+                          size_t(header->num_nodes), reinterpret_cast<const uint32_t*>(data + header->order_offset));
+            break;
+        default:
+            // the other indices are rebuilt over a private copy, which the
+            // dynamic index can also append to
+            photon_map.assign(stored, stored + count);
+            cache_map.close();
+            build_kdtree();
+            return true;
+    }
+    photon_records = stored;
+    gather_radius = header->gather_radius;
+    if (options.irradiance_error > 0) irradiance_cache.init(photon_bounds, options.irradiance_error);
+    return true;
+}
+void PhotonMapping::save_cache() const {
+    // after build_kdtree, so the photons are stored in index order, and
+    // before precompute_radiance, which the load repeats
+    if (options.cache_file.empty() || photon_map.empty()) return;
+    bool flat_index = options.index == PhotonIndex::NanoFlann;
+    PhotonCacheHeader header = {};
+    std::memcpy(header.magic, c_photon_cache_magic, 8);
+    header.version = c_photon_cache_version;
+    header.index = uint32_t(options.index);
+    header.scene_hash = options.scene_hash;
+    header.params_hash = cache_key();
+    header.num_emitted = uint64_t(num_emitted);
+    header.num_photons = photon_map.size();
+    header.num_sites = radiance_map.size();
+    header.photon_offset = align_cache_offset(sizeof(PhotonCacheHeader));
+    header.site_offset = align_cache_offset(header.photon_offset + header.num_photons * sizeof(Photon));
+    header.num_nodes = flat_index ? kdtree.node_count() : 0;
+    header.node_offset = align_cache_offset(header.site_offset + header.num_sites * sizeof(Photon));
+    header.order_offset = align_cache_offset(header.node_offset + header.num_nodes * sizeof(FlatKDNode));
+    header.bounds = photon_bounds;
+    header.gather_radius = gather_radius;
+
+    // written to a file of this process's own next to the cache file and
+    // renamed over it, so no process maps a partial or mixed file and those
+    // mapping the old one keep their copy. the cache is only an optimisation:
+    // when it cannot be written the render goes on without it.
+    std::string temp = unique_temp_path(options.cache_file);
+    std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Warning: cannot write photon cache " << temp << std::endl;
+        return;
+    }
+    uint64_t position = 0;
+    auto write_at = [&](uint64_t offset, const void* bytes, size_t size) {
+        static const char zeros[64] = {};
+        out.write(zeros, std::streamsize(offset - position));
+        out.write(static_cast<const char*>(bytes), std::streamsize(size));
+        position = offset + size;
+    };
+    write_at(0, &header, sizeof(header));
+    write_at(header.photon_offset, photon_map.data(), photon_map.size() * sizeof(Photon));
+    write_at(header.site_offset, radiance_map.data(), radiance_map.size() * sizeof(Photon));
+    if (flat_index) {
+        write_at(header.node_offset, kdtree.node_data(), header.num_nodes * sizeof(FlatKDNode));
+        write_at(header.order_offset, kdtree.order_data(), photon_map.size() * sizeof(uint32_t));
+    }
+    out.close();
+    if (!out) {
+        std::cerr << "Warning: cannot write photon cache " << temp << std::endl;
+        std::remove(temp.c_str());
+        return;
+    }
+    if (!replace_file(temp, options.cache_file)) {
+        std::cerr << "Warning: cannot replace photon cache " << options.cache_file
+                  << ", it may be in use by another process" << std::endl;
+        std::remove(temp.c_str());
+    }
+}
+void PhotonMapping::precompute_radiance(size_t first_site) {
+    // irradiance at the radiance photons from first_site on from a regular
+    // gather, counting only the photons that arrive on the side its normal faces
+    if (first_site >= radiance_map.size()) return;
+    int64_t num_sites = int64_t(radiance_map.size() - first_site);
+    int64_t num_chunks = (num_sites + c_photon_chunk_size - 1) / c_photon_chunk_size;
+    parallel_for([&](int64_t chunk) {
+        thread_local PhotonGather gather;
+        thread_local PhotonFluxBatch batch;
+        int64_t begin = int64_t(first_site) + chunk * c_photon_chunk_size;
+        int64_t end = std::min(begin + c_photon_chunk_size, int64_t(radiance_map.size()));
+        for (int64_t i = begin; i < end; i++) {
+            Photon& site = radiance_map[i];
+            gather_photons(site.position(), gather);
+            if (gather.count == 0) continue;
+            Vector3 n = site.direction();
+            float normal[3] = {float(n.x), float(n.y), float(n.z)};
+            float front[3], back[3];
+            batch.assign(gather, photon_records);
+            accumulate_flux(batch, normal, normal, front, back);
+            Spectrum flux{front[0], front[1], front[2]};
+            site.power = encode_rgbe(flux / (c_PI * gather.max_dist2 * Real(num_emitted)));
+        }
+    }, num_chunks);
+
+    // a growing photon map appends its new sites to a dynamic index
+    if (first_site == 0) radiance_bounds = PhotonBounds{};
+    for (size_t i = first_site; i < radiance_map.size(); i++) radiance_bounds.expand(radiance_map[i]);
+    if (options.index != PhotonIndex::Dynamic) radiance_kdtree.build(radiance_map, radiance_bounds);
+    else if (first_site == 0) radiance_dynamic_kdtree.build(radiance_map, radiance_bounds);
+    else radiance_dynamic_kdtree.append(radiance_map, radiance_bounds);
+}
+bool PhotonMapping::radiance_lookup(const PathVertex& isect, const Vector3& wo, Spectrum& indirect) const {
+    // only diffuse surfaces can reuse the irradiance of a nearby radiance photon
+    if (radiance_map.empty() || is_light(scene.shapes[isect.shape_id])) return false;
+    const Lambertian* lambertian = std::get_if<Lambertian>(&scene.materials[isect.material_id]);
+    if (!lambertian) return false;
+    if (dot(isect.geometric_normal, wo) < 0) {
+        indirect = make_zero_spectrum();
+        return true;
+    }
+
+    // nearest radiance photon facing the same way as the viewed side
+    Vector3 n = isect.shading_frame.n;
+    if (dot(n, wo) < 0) n = -n;
+    float query[3] = {float(isect.position.x), float(isect.position.y), float(isect.position.z)};
+    thread_local PhotonGather nearest;
+    if (options.index == PhotonIndex::Dynamic) radiance_dynamic_kdtree.findNearestN(query, c_radiance_lookups, nearest);
+    else radiance_kdtree.findNearestN(query, c_radiance_lookups, nearest);
+    const Photon* site = nullptr;
+    float site_dist2 = std::numeric_limits<float>::max();
+    for (size_t i = 0; i < nearest.count; i++) {
+        const Photon& candidate = radiance_map[nearest.indices[i]];
+        if (nearest.dist2[i] < site_dist2 && dot(candidate.direction(), n) > c_radiance_min_cos) {
+            site = &candidate;
+            site_dist2 = nearest.dist2[i];
+        }
+    }
+    if (!site) return false;
+    Spectrum albedo = eval(lambertian->reflectance, isect.uv, isect.uv_screen_size, scene.texture_pool);
+    indirect = albedo * site->energy() / c_PI;
+    return true;
+}
+bool PhotonMapping::irradiance_lookup(const PathVertex& isect, const Vector3& wo, Spectrum& indirect) {
+    // the cache holds irradiance, so only diffuse surfaces can use it
+    if (options.irradiance_error <= 0 || is_light(scene.shapes[isect.shape_id])) return false;
+    const Lambertian* lambertian = std::get_if<Lambertian>(&scene.materials[isect.material_id]);
+    if (!lambertian) return false;
+    if (dot(isect.geometric_normal, wo) < 0) {
+        indirect = make_zero_spectrum();
+        return true;
+    }
+    Vector3 n = isect.shading_frame.n;
+    if (dot(n, wo) < 0) n = -n;
+
+    Spectrum irradiance;
+    if (!irradiance_cache.lookup(isect.position, n, irradiance)) {
+        // new record from a regular gather. the photon estimate is already
+        // blurred over the gather radius, which makes it the validity radius.
+        // the irradiance is weighted with the Epanechnikov kernel
+        // 2 / (pi r^2) (1 - d^2 / r^2) over the tangent plane, and the
+        // gradient is the derivative of that same estimate. photons are
+        // counted on the side reflected_flux counts them: above the
+        // geometric normal and on the viewed side of the shading normal.
+        thread_local PhotonGather gather;
+        gather_photons(isect.position, gather);
+        if (gather.count == 0) return false;
+        IrradianceCache::Record record;
+        record.position = isect.position;
+        record.normal = n;
+        record.radius = sqrt(Real(gather.max_dist2));
+        record.irradiance = make_zero_spectrum();
+        for (int c = 0; c < 3; c++) record.gradient[c] = Vector3{0, 0, 0};
+        Real r2 = Real(gather.max_dist2);
+        for (size_t i = 0; i < gather.count; i++) {
+            const Photon& photon = photon_records[gather.indices[i]];
+            Vector3 dir = photon.direction();
+            if (dot(isect.geometric_normal, dir) < 0 || dot(n, dir) < 0) continue;
+            Spectrum power = photon.energy();
+            Vector3 d = photon.position() - isect.position;
+            d = d - n * dot(n, d);
+            record.irradiance += power * fmax(Real(1) - dot(d, d) / r2, Real(0));
+            for (int c = 0; c < 3; c++) record.gradient[c] += d * power[c];
+        }
+        Real num_photons = Real(num_emitted);
+        record.irradiance *= Real(2) / (c_PI * r2 * num_photons);
+        for (int c = 0; c < 3; c++) record.gradient[c] *= Real(4) / (c_PI * r2 * r2 * num_photons);
+        irradiance_cache.insert(record);
+        irradiance = record.irradiance;
+    }
+    Spectrum albedo = eval(lambertian->reflectance, isect.uv, isect.uv_screen_size, scene.texture_pool);
+    indirect = albedo * irradiance / c_PI;
+    return true;
+}
+void PhotonMapping::gather_photons(const Vector3& position, PhotonGather& gather, bool camera_query) const {
+    float query[3] = {float(position.x), float(position.y), float(position.z)};
+    if (options.gather == GatherMode::Radius) {
+        find_within_radius(query, gather_radius, gather);
+        return;
+    }
+    size_t n = options.n_neighbors;
+    // a bounded gather stops at n photons or at gather_radius, whichever
+    // comes first, capping its cost in both sparse and dense regions
+    float limit = options.gather == GatherMode::Bounded ? gather_radius * gather_radius
+                                                        : std::numeric_limits<float>::max();
+    // a camera query is seeded with the radius of the previous camera query
+    // into the same scratch, which is usually the neighbouring pixel. other
+    // queries land far from it and neither use nor move the hint. a seeded
+    // search that finds fewer than n photons is widened, so the result is
+    // always exact.
+    bool seeded = camera_query && options.radius_hint;
+    if (seeded && gather.radius_hint2 > 0) {
+        float bound = gather.radius_hint2 * 1.5f * 1.5f;
+        for (int attempt = 0; attempt < 2 && bound < limit; attempt++, bound *= 4) {
+            find_nearest(query, n, gather, bound);
+            if (gather.count == n) {
+                gather.radius_hint2 = gather.max_dist2;
+                return;
+            }
+        }
+    }
+    find_nearest(query, n, gather, limit);
+    if (seeded && gather.count == n) gather.radius_hint2 = gather.max_dist2;
+    // fewer than n photons: the whole gather sphere was searched
+    else if (options.gather == GatherMode::Bounded) gather.max_dist2 = limit;
+}
+void PhotonMapping::find_nearest(const float query[3], size_t n, PhotonGather& gather, float max_dist2) const {
+    // the common neighbour counts get a heap specialised on k
+    switch (n) {
+        case 50: find_nearest_fixed<50>(query, gather, max_dist2); return;
+        case 100: find_nearest_fixed<100>(query, gather, max_dist2); return;
+        case 200: find_nearest_fixed<200>(query, gather, max_dist2); return;
+        case 500: find_nearest_fixed<500>(query, gather, max_dist2); return;
+        default: break;
+    }
+    switch (options.index) {
+        case PhotonIndex::Balanced: balanced_kdtree.findNearestN(query, n, gather, max_dist2); break;
+        case PhotonIndex::HashGrid: hashgrid.findNearestN(query, n, gather, max_dist2); break;
+        case PhotonIndex::Simd: simd_kdtree.findNearestN(query, n, gather, max_dist2); break;
+        case PhotonIndex::Dynamic: dynamic_kdtree.findNearestN(query, n, gather, max_dist2); break;
+        default: kdtree.findNearestN(query, n, gather, max_dist2); break;
+    }
+}
+template <size_t K>
+void PhotonMapping::find_nearest_fixed(const float query[3], PhotonGather& gather, float max_dist2) const {
+    // the hash grid cannot see beyond one cell
+    if (options.index == PhotonIndex::HashGrid) max_dist2 = std::min(max_dist2, hashgrid.cell_size2());
+    gather.reserve(K);
+    FixedKNNHeap<K> heap(max_dist2);
+    heap.init(gather.indices.data(), gather.dist2.data());
+    switch (options.index) {
+        case PhotonIndex::Balanced: balanced_kdtree.findNeighbors(heap, query); break;
+        case PhotonIndex::HashGrid: hashgrid.findNeighbors(heap, query); break;
+        case PhotonIndex::Simd: simd_kdtree.findNeighbors(heap, query); break;
+        case PhotonIndex::Dynamic: dynamic_kdtree.findNeighbors(heap, query); break;
+        default: kdtree.findNeighbors(heap, query); break;
+    }
+    gather.count = heap.size();
+    gather.max_dist2 = gather.count > 0 ? gather.dist2[0] : 0.f;
+}
+void PhotonMapping::find_within_radius(const float query[3], float radius, PhotonGather& gather) const {
+    switch (options.index) {
+        case PhotonIndex::Balanced: balanced_kdtree.findPhotonsWithinRadius(query, radius, gather); break;
+        case PhotonIndex::HashGrid: hashgrid.findPhotonsWithinRadius(query, radius, gather); break;
+        case PhotonIndex::Simd: simd_kdtree.findPhotonsWithinRadius(query, radius, gather); break;
+        case PhotonIndex::Dynamic: dynamic_kdtree.findPhotonsWithinRadius(query, radius, gather); break;
+        default: kdtree.findPhotonsWithinRadius(query, radius, gather); break;
+    }
 }
 Real get_area(const Light& light, const Scene& scene){
     const DiffuseAreaLight* areaLight = std::get_if<DiffuseAreaLight>(&light);
@@ -23,62 +350,143 @@ Real get_area(const Light& light, const Scene& scene){
 
 
 ///------------------------------ Photon Tracing ------------------------------------///
-void PhotonMapping::photon_tracing(pcg32_state& rng){
-    for (int i = 0; i < num_photons; i++) {
-        // sample position
-        Vector2 light_uv{ next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng) };
-        Real light_w = next_pcg32_real<Real>(rng);
-        Real shape_w = next_pcg32_real<Real>(rng);
-        int light_id = sample_light(scene, light_w);
-        const Light& light = scene.lights[light_id];
-        Vector3 dummy_ref_point(0,0,0);
-        PointAndNormal point_on_light = sample_point_on_light(light, dummy_ref_point, light_uv, shape_w, scene);
-        Vector3 pos = point_on_light.position;
-
-        // sample direction
-        Vector2 uv(next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng));
-        Frame frame(point_on_light.normal);
-        Vector3 dir = to_world(frame, sample_cos_hemisphere(uv));
-            
-        // create a photon ray
-        Ray photon_ray{pos, dir, get_shadow_epsilon(scene), infinity<Real>()};
-
-        // compute del flux of photon
-        Real area = get_area(light, scene);
-        Spectrum Le = emission(light, dir, 0, point_on_light, scene);
-        Spectrum beta = area * Le * c_PI; //TODO
-
-        // photon mapping
-        Spectrum throughput = make_const_spectrum(1.0);
-        for (int bounce = 0; bounce < max_depth; bounce++) {
-            std::optional<PathVertex> vertex_ = intersect(scene, photon_ray);
-            if (!vertex_) {break;}
-            PathVertex vertex = *vertex_;
-            if(is_light(scene.shapes[vertex.shape_id])) break; //TODO break if the vertex is light source
-
-            if(bounce >= 1) //TODO for only indirect illumination
-                store_photon(vertex.position, -photon_ray.dir, beta * throughput); 
-            std::optional<Ray> reflected_ray = bounce_photon(vertex, photon_ray, throughput, rng);
-
-            if (!reflected_ray) break;
-            else photon_ray = *reflected_ray;
-            
-            //Russian roulete
-            if(bounce > 1){
-                Real rr_prob = min(max(throughput), 0.95);
-                Real rand = next_pcg32_real<Real>(rng);
-                if (rand >= rr_prob) break; 
-                else throughput /= rr_prob;
-            }
+void PhotonMapping::photon_tracing(int64_t first_photon){
+    // first_photon selects the pcg32 streams, so later passes trace new photons
+    trace_range(first_photon, options.num_photons);
+}
+void PhotonMapping::add_photons(int64_t num_photons){
+    // trace the next photon paths and index only them; the estimates
+    // are normalised by all photon paths traced so far. only the new
+    // radiance photons are estimated, the earlier ones keep their estimate
+    // from the photons traced before, so an append costs O(m log n).
+    if (options.index != PhotonIndex::Dynamic)
+        throw std::runtime_error("appending photons needs the dynamic photon index");
+    size_t first_site = radiance_map.size();
+    trace_range(next_photon, num_photons);
+    dynamic_kdtree.append(photon_map, photon_bounds);
+    photon_records = photon_map.data();
+    if (options.irradiance_error > 0) irradiance_cache.init(photon_bounds, options.irradiance_error);
+    precompute_radiance(first_site);
+}
+void PhotonMapping::trace_range(int64_t first_photon, int64_t num_photons){
+    // photons are traced in fixed-size chunks across the thread pool,
+    // each chunk fills its own buffer and the buffers are merged in chunk order
+    int64_t num_chunks = num_photon_chunks(num_photons);
+    std::vector<std::vector<Photon>> buffers(num_chunks);
+    parallel_for([&](int64_t chunk) {
+        trace_chunk(first_photon, num_photons, chunk, buffers[chunk]);
+    }, num_chunks);
+    merge_photons(first_photon, num_photons, buffers);
+}
+void PhotonMapping::trace_chunk(int64_t first_photon, int64_t num_photons, int64_t chunk, std::vector<Photon>& photons){
+    // the chunk-th c_photon_chunk_size paths of the range, replacing the buffer's photons
+    photons.clear();
+    int64_t begin = first_photon + chunk * c_photon_chunk_size;
+    int64_t end = std::min(begin + c_photon_chunk_size, first_photon + num_photons);
+    if (options.tracer == PhotonTracer::Wavefront) trace_wavefront(begin, end, photons);
+    else trace_photons(begin, end, photons);
+}
+void PhotonMapping::merge_photons(int64_t first_photon, int64_t num_photons, const std::vector<std::vector<Photon>>& buffers){
+    // append the chunk buffers of trace_range's photon paths, in chunk order
+    num_emitted += num_photons;
+    next_photon = first_photon + num_photons;
+    size_t first = photon_map.size();
+    size_t total = first;
+    for (const std::vector<Photon>& buffer : buffers) total += buffer.size();
+    photon_map.reserve(total);
+    for (const std::vector<Photon>& buffer : buffers) {
+        for (const Photon& photon : buffer) photon_bounds.expand(photon);
+        photon_map.insert(photon_map.end(), buffer.begin(), buffer.end());
+    }
+
+    // every stride-th of the new photons becomes a radiance photon, before
+    // the index build reorders the map and reuses the normal bits
+    if (options.radiance_stride > 0) {
+        size_t stride = size_t(options.radiance_stride);
+        for (size_t i = (first + stride - 1) / stride * stride; i < photon_map.size(); i += stride) {
+            Photon site = photon_map[i];
+            site.dir = site.flag;
+            site.flag = 0;
+            site.power = 0;
+            radiance_map.push_back(site);
+        }
+    }
+}
+void PhotonMapping::trace_photons(int64_t begin, int64_t end, std::vector<Photon>& photons){
+    // any range of photon indices produces the same photons on any thread
+    for (int64_t i = begin; i < end; i++) {
+        trace_photon(i, photons);
+    }
+}
+Ray PhotonMapping::emit_photon(pcg32_state& rng, Spectrum& beta){
+    // sample position
+    Vector2 light_uv{ next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng) };
+    Real light_w = next_pcg32_real<Real>(rng);
+    Real shape_w = next_pcg32_real<Real>(rng);
+    int light_id = sample_light(scene, light_w);
+    const Light& light = scene.lights[light_id];
+    Vector3 dummy_ref_point(0,0,0);
+    PointAndNormal point_on_light = sample_point_on_light(light, dummy_ref_point, light_uv, shape_w, scene);
+    Vector3 pos = point_on_light.position;
+
+    // sample direction
+    Vector2 uv(next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng));
+    Frame frame(point_on_light.normal);
+    Vector3 dir = to_world(frame, sample_cos_hemisphere(uv));
+
+    // compute del flux of photon
+    Real area = get_area(light, scene);
+    Spectrum Le = emission(light, dir, 0, point_on_light, scene);
+    beta = area * Le * c_PI; //TODO
+
+    // create a photon ray
+    return Ray{pos, dir, get_shadow_epsilon(scene), infinity<Real>()};
+}
+Photon PhotonMapping::make_photon(const PathVertex& vertex, const Vector3& dir, const Spectrum& power) const {
+    Photon photon{vertex.position, dir, power};
+    // radiance photons need the normal of the side the photon arrived on
+    if (options.radiance_stride > 0) {
+        Vector3 n = vertex.shading_frame.n;
+        photon.flag = encode_octahedral(dot(n, dir) < 0 ? -n : n);
+    }
+    return photon;
+}
+void PhotonMapping::trace_photon(int64_t index, std::vector<Photon>& photons){
+    pcg32_state rng = init_pcg32(uint64_t(index), c_photon_seed);
+    Spectrum beta;
+    Ray photon_ray = emit_photon(rng, beta);
+
+    // photon mapping
+    Spectrum throughput = make_const_spectrum(1.0);
+    for (int bounce = 0; bounce < options.max_depth; bounce++) {
+        std::optional<PathVertex> vertex_ = intersect(scene, photon_ray);
+        if (!vertex_) {break;}
+        PathVertex vertex = *vertex_;
+        if(is_light(scene.shapes[vertex.shape_id])) break; //TODO break if the vertex is light source
+
+        if(bounce >= 1) //TODO for only indirect illumination
+            photons.push_back(make_photon(vertex, -photon_ray.dir, beta * throughput));
+        const Material& mat = scene.materials[vertex.material_id];
+        std::optional<Ray> reflected_ray = bounce_photon(mat, vertex, photon_ray, throughput, rng);
+
+        if (!reflected_ray) break;
+        else photon_ray = *reflected_ray;
+        
+        //Russian roulete
+        if(bounce > 1){
+            Real rr_prob = min(max(throughput), 0.95);
+            Real rand = next_pcg32_real<Real>(rng);
+            if (rand >= rr_prob) break; 
+            else throughput /= rr_prob;
         }
     }
 }
-std::optional<Ray> PhotonMapping::bounce_photon(PathVertex isect, Ray photon_ray, Spectrum &beta, pcg32_state& rng) {
+std::optional<Ray> PhotonMapping::bounce_photon(const Material& mat, const PathVertex& isect, const Ray& photon_ray, 
+                                                Spectrum &beta, pcg32_state& rng) {
     // sample direction
     Vector2 bsdf_rnd_param_uv{next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng)};
     Real bsdf_rnd_param_w = next_pcg32_real<Real>(rng);
     Vector3 wi = -photon_ray.dir;
-    Material mat = scene.materials[isect.material_id];
     std::optional<BSDFSampleRecord> bsdf_sample_ = sample_bsdf(mat, wi, isect, scene.texture_pool, 
                                                                bsdf_rnd_param_uv, bsdf_rnd_param_w,  TransportDirection::TO_VIEW);
     if (!bsdf_sample_) return std::nullopt; 
@@ -109,6 +517,54 @@ std::optional<Ray> PhotonMapping::bounce_photon(PathVertex isect, Ray photon_ray
 
 ///------------------------------ Rendering ------------------------------------///
 Spectrum PhotonMapping::camera_tracing(int x, int y, pcg32_state& rng) {
+    CameraHit hit = camera_hit(x, y, rng);
+    if (!hit.hit) return hit.radiance;
+
+    // indirect illumination
+    if (options.final_gather_rays > 0) return hit.radiance + final_gather(hit.isect, hit.wo, rng);
+    return hit.radiance + photon_estimate(hit.isect, hit.wo);
+}
+Spectrum PhotonMapping::photon_estimate(const PathVertex& isect, const Vector3& wo, bool camera_query) {
+    Spectrum cached;
+    if (radiance_lookup(isect, wo, cached) || irradiance_lookup(isect, wo, cached)) return cached;
+
+    //find N-th nearest neighbors at query point.
+    thread_local PhotonGather gather;
+    gather_photons(isect.position, gather, camera_query);
+    return indirct_illumination(isect, wo, gather);
+}
+Spectrum PhotonMapping::final_gather(const PathVertex& isect, const Vector3& wo, pcg32_state& rng) {
+    // same convention as indirct_illumination
+    if (is_light(scene.shapes[isect.shape_id])) return emission(isect, wo, scene);
+
+    // one bounce of BSDF sampling; the photon map is only read at the
+    // secondary hits, where its blotches are blurred out by the integral.
+    // emitters are skipped, the first hit already samples them directly.
+    const Material& mat = scene.materials[isect.material_id];
+    Spectrum indirect = make_zero_spectrum();
+    for (int i = 0; i < options.final_gather_rays; i++) {
+        Vector2 bsdf_rnd_param_uv{next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng)};
+        Real bsdf_rnd_param_w = next_pcg32_real<Real>(rng);
+        std::optional<BSDFSampleRecord> bsdf_sample_ = sample_bsdf(mat, wo, isect, scene.texture_pool,
+                                                                   bsdf_rnd_param_uv, bsdf_rnd_param_w);
+        if (!bsdf_sample_) continue;
+        Vector3 dir = bsdf_sample_->dir_out;
+        Real pdf = pdf_sample_bsdf(mat, wo, dir, isect, scene.texture_pool);
+        if (pdf <= 0) continue;
+        Spectrum f = eval(mat, wo, dir, isect, scene.texture_pool);
+
+        Ray gather_ray{isect.position, dir, get_intersection_epsilon(scene), infinity<Real>()};
+        std::optional<PathVertex> vertex_ = intersect(scene, gather_ray);
+        if (!vertex_ || is_light(scene.shapes[vertex_->shape_id])) continue;
+        Spectrum L = dirct_illumination(*vertex_, -dir, rng) + photon_estimate(*vertex_, -dir, false);
+        indirect += f * L / pdf;
+    }
+    return indirect / Real(options.final_gather_rays);
+}
+CameraHit PhotonMapping::camera_hit(int x, int y, pcg32_state& rng) {
+    CameraHit hit{x, y, false};
+    hit.radiance = make_zero_spectrum();
+
     // create a camera ray
     int w = scene.camera.width, h = scene.camera.height;
     Vector2 screen_pos((x + next_pcg32_real<Real>(rng)) / w,
@@ -117,26 +573,93 @@ Spectrum PhotonMapping::camera_tracing(int x, int y, pcg32_state& rng) {
 
     // find intersection
     std::optional<PathVertex> vertex_ = intersect(scene, ray);
-    if (!vertex_) return make_zero_spectrum();
-    PathVertex isect = *vertex_;
-    const Material& mat = scene.materials[isect.material_id];
-
-    //find N-th nearest neighbors at query point.
-    float query[3] = {isect.position.x, isect.position.y, isect.position.z};
-    float radius2;
-    std::vector<size_t> neighbors = kdtree.findNearestN(query, n_neighbors, radius2);
-    // float radius = 10.0f;
-    // float radius2 = radius * radius;
-    // std::vector<size_t> neighbors = kdtree.findPhotonsWithinRadius(query, radius);
+    if (!vertex_) return hit;
+    hit.hit = true;
+    hit.isect = *vertex_;
+    hit.wo = -ray.dir;
 
     // direct illumination
     //Spectrum direct = make_zero_spectrum();
-    Spectrum direct = dirct_illumination(isect, -ray.dir, rng);
-
-    // indirect illumination
-    //Spectrum indirect = make_zero_spectrum();
-    Spectrum indirect =  indirct_illumination(isect, -ray.dir, neighbors, radius2);
-    return direct + indirect;
+    hit.radiance = dirct_illumination(hit.isect, hit.wo, rng);
+    return hit;
+}
+void PhotonMapping::gather_hits(std::vector<CameraHit>& hits, pcg32_state& rng) {
+    // answer the gathers in Z-order so that consecutive queries
+    // descend through the same nodes and touch the same photons
+    thread_local std::vector<std::pair<uint64_t, uint32_t>> order;
+    order.clear();
+    for (size_t i = 0; i < hits.size(); i++) {
+        if (!hits[i].hit) continue;
+        if (options.final_gather_rays > 0) {
+            hits[i].radiance += final_gather(hits[i].isect, hits[i].wo, rng);
+            continue;
+        }
+        Spectrum cached;
+        if (radiance_lookup(hits[i].isect, hits[i].wo, cached) || irradiance_lookup(hits[i].isect, hits[i].wo, cached)) {
+            hits[i].radiance += cached;
+            continue;
+        }
+        const Vector3& p = hits[i].isect.position;
+        float pos[3] = {float(p.x), float(p.y), float(p.z)};
+        order.push_back({morton_code(pos, photon_bounds), uint32_t(i)});
+    }
+    std::sort(order.begin(), order.end());
+
+    thread_local TilePhotons tile;
+    bool prefetched = options.camera_gather == CameraGather::Prefetch && prefetch_tile(hits, tile);
+
+    thread_local PhotonGather gather;
+    for (const std::pair<uint64_t, uint32_t>& entry : order) {
+        CameraHit& hit = hits[entry.second];
+        const Vector3& p = hit.isect.position;
+        float query[3] = {float(p.x), float(p.y), float(p.z)};
+        bool found = false;
+        if (prefetched) {
+            if (options.gather == GatherMode::Radius) {
+                found = tile.find_within_radius(query, gather_radius, gather);
+            } else if (options.gather == GatherMode::Bounded) {
+                float limit = gather_radius * gather_radius;
+                found = tile.find_nearest(query, options.n_neighbors, gather, limit);
+                if (found && gather.count < size_t(options.n_neighbors)) gather.max_dist2 = limit;
+            } else {
+                found = tile.find_nearest(query, options.n_neighbors, gather);
+            }
+        }
+        if (!found) gather_photons(p, gather, true);
+        hit.radiance += indirct_illumination(hit.isect, hit.wo, gather);
+    }
+}
+bool PhotonMapping::prefetch_tile(const std::vector<CameraHit>& hits, TilePhotons& tile) const {
+    // the hash grid cannot answer queries wider than its cells
+    if (options.index == PhotonIndex::HashGrid) return false;
+
+    PhotonBounds bounds;
+    for (const CameraHit& hit : hits) {
+        if (!hit.hit) continue;
+        bounds.expand(hit.isect.position);
+    }
+    if (bounds.lo[0] > bounds.hi[0]) return false;
+    Vector3 center{(bounds.lo[0] + bounds.hi[0]) / 2, (bounds.lo[1] + bounds.hi[1]) / 2, (bounds.lo[2] + bounds.hi[2]) / 2};
+    Vector3 extent{bounds.hi[0] - bounds.lo[0], bounds.hi[1] - bounds.lo[1], bounds.hi[2] - bounds.lo[2]};
+
+    // one regular gather at the hit nearest to the center sizes the margin
+    const CameraHit* middle = nullptr;
+    for (const CameraHit& hit : hits) {
+        if (hit.hit && (!middle || distance_squared(hit.isect.position, center) < distance_squared(middle->isect.position, center)))
+            middle = &hit;
+    }
+    thread_local PhotonGather range;
+    gather_photons(middle->isect.position, range);
+    if (range.count == 0) return false;
+    float r0 = options.gather == GatherMode::Radius ? gather_radius : std::sqrt(range.max_dist2);
+    float radius = float(length(extent)) / 2 + 2 * r0;
+    // tiles spanning depth discontinuities would pull in far too many photons
+    if (radius > 4 * r0) return false;
+
+    float query[3] = {float(center.x), float(center.y), float(center.z)};
+    find_within_radius(query, radius, range);
+    tile.assign(query, radius, range, photon_records);
+    return true;
 }
 Spectrum PhotonMapping::dirct_illumination(PathVertex isect, Vector3 dir_view, pcg32_state& rng) {
     // return emission if isect is light source
@@ -166,27 +689,54 @@ Spectrum PhotonMapping::dirct_illumination(PathVertex isect, Vector3 dir_view, p
                pdf_point_on_light(light, point_on_light, isect.position, scene);
     return (Li * f * G) / pdf;
 }
-Spectrum PhotonMapping::indirct_illumination(PathVertex isect, Vector3 wo, std::vector<size_t> neighbors, Real radius2){
-    const Material& mat = scene.materials[isect.material_id];    
-    Spectrum indirect = make_zero_spectrum();
+Spectrum PhotonMapping::indirct_illumination(const PathVertex& isect, const Vector3& wo, const PhotonGather& gather){
     if (is_light(scene.shapes[isect.shape_id])) return emission(isect, wo, scene);
-    for (const size_t& index : neighbors) {
-        const Photon& photon = photon_map[index];
-
-        Spectrum f = eval(mat, photon.direction, wo, isect, scene.texture_pool, TransportDirection::TO_VIEW); 
-
-        //cancel cosin term
-        Frame frame = isect.shading_frame;
-        if (dot(frame.n, photon.direction) < 0) {frame = -frame;}
-        Real offset = fmax(dot(frame.n, wo), Real(0));
-        if(offset > 0.0001) f /= offset;
+    if (gather.count == 0) return make_zero_spectrum();
+    Spectrum indirect = reflected_flux(isect, wo, gather);
+    return indirect / (c_PI * gather.max_dist2 * Real(num_emitted)); //divided by n phton at the end
+}
+Spectrum PhotonMapping::reflected_flux(const PathVertex& isect, const Vector3& wo, const PhotonGather& gather) const {
+    // the BSDF cosine is cancelled against the shading frame, flipped to the
+    // photon's side. there are only two such frames per query, so both
+    // cosines are computed up front.
+    constexpr Real min_cosine = 0.0001;
+    Frame frame = isect.shading_frame;
+    Real cos_front = fmax(dot(frame.n, wo), Real(0));
+    Real cos_back = fmax(-dot(frame.n, wo), Real(0));
 
-        indirect += photon.energy * f;
+    const Material& mat = scene.materials[isect.material_id];
+    if (const Lambertian* lambertian = std::get_if<Lambertian>(&mat)) {
+        // the Lambertian BSDF is albedo / pi on either side: sum the photon
+        // powers per side, 8 photons at a time, and look the albedo up once
+        if (dot(isect.geometric_normal, wo) < 0) return make_zero_spectrum();
+        thread_local PhotonFluxBatch batch;
+        batch.assign(gather, photon_records);
+        float ng[3] = {float(isect.geometric_normal.x), float(isect.geometric_normal.y), float(isect.geometric_normal.z)};
+        float n[3] = {float(frame.n.x), float(frame.n.y), float(frame.n.z)};
+        float front_sum[3], back_sum[3];
+        accumulate_flux(batch, ng, n, front_sum, back_sum);
+        Spectrum front{front_sum[0], front_sum[1], front_sum[2]};
+        Spectrum back{back_sum[0], back_sum[1], back_sum[2]};
+        // below min_cosine the cosine is left in, as eval() would
+        Real w_front = cos_front > min_cosine ? Real(1) : cos_front;
+        Real w_back = cos_back > min_cosine ? Real(1) : cos_back;
+        Spectrum albedo = eval(lambertian->reflectance, isect.uv, isect.uv_screen_size, scene.texture_pool);
+        return albedo * (front * w_front + back * w_back) / c_PI;
     }
-    if(neighbors.size() > 0){
-         indirect /= (c_PI * radius2 * Real(num_photons)); //divided by n phton at the end
+
+    // other BSDFs depend on the photon direction and are evaluated per
+    // photon, on a copy of the material with its textures looked up once
+    Material baked = bake_textures(mat, isect, scene.texture_pool);
+    Spectrum flux = make_zero_spectrum();
+    for (size_t i = 0; i < gather.count; i++) {
+        const Photon& photon = photon_records[gather.indices[i]];
+        Vector3 photon_dir = photon.direction();
+        Spectrum f = eval(baked, photon_dir, wo, isect, scene.texture_pool, TransportDirection::TO_VIEW);
+        Real cosine = dot(frame.n, photon_dir) < 0 ? cos_back : cos_front;
+        if (cosine > min_cosine) f /= cosine;
+        flux += photon.energy() * f;
     }
-    return indirect;
+    return flux;
 }
 
 
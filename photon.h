@@ -5,11 +5,23 @@
 #include "vector.h"
 #include "scene.h"
 #include "pcg.h"
+#include "parallel.h"
 #include "utils.h"
+#include "photon_record.h"
 #include "kdtree.cpp"
+#include "balanced_kdtree.h"
+#include "hashgrid.h"
+#include "simd_kdtree.h"
+#include "morton.h"
+#include "photon_flux.h"
+#include "irradiance_cache.h"
+#include "photon_cache.h"
 #include <fstream>
 #include <algorithm>
 #include <array>
+#include <limits>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 inline Vector3 sample_cos_hemisphere(const Vector2& rnd_param) {
@@ -21,30 +33,195 @@ inline Vector3 sample_cos_hemisphere(const Vector2& rnd_param) {
     };
 }
 
-struct Photon {
-    Vector3 position;
-    Vector3 direction;
-    Spectrum energy;
+// a material with every texture replaced by a constant holding its value
+// at one vertex. BSDF evaluations of the copy at that vertex give the same
+// result without any texture lookups.
+template <typename T>
+inline void bake_texture(Texture<T>& texture, const PathVertex& vertex, const TexturePool& pool) {
+    texture = ConstantTexture<T>{eval(texture, vertex.uv, vertex.uv_screen_size, pool)};
+}
+inline void bake_textures(Lambertian& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.reflectance, v, pool);
+}
+inline void bake_textures(RoughPlastic& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.diffuse_reflectance, v, pool);
+    bake_texture(m.specular_reflectance, v, pool);
+    bake_texture(m.roughness, v, pool);
+}
+inline void bake_textures(RoughDielectric& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.specular_reflectance, v, pool);
+    bake_texture(m.specular_transmittance, v, pool);
+    bake_texture(m.roughness, v, pool);
+}
+inline void bake_textures(DisneyDiffuse& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.base_color, v, pool);
+    bake_texture(m.roughness, v, pool);
+    bake_texture(m.subsurface, v, pool);
+}
+inline void bake_textures(DisneyMetal& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.base_color, v, pool);
+    bake_texture(m.roughness, v, pool);
+    bake_texture(m.anisotropic, v, pool);
+}
+inline void bake_textures(DisneyGlass& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.base_color, v, pool);
+    bake_texture(m.roughness, v, pool);
+    bake_texture(m.anisotropic, v, pool);
+}
+inline void bake_textures(DisneyClearcoat& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.clearcoat_gloss, v, pool);
+}
+inline void bake_textures(DisneySheen& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.base_color, v, pool);
+    bake_texture(m.sheen_tint, v, pool);
+}
+inline void bake_textures(DisneyBSDF& m, const PathVertex& v, const TexturePool& pool) {
+    bake_texture(m.base_color, v, pool);
+    bake_texture(m.specular_transmission, v, pool);
+    bake_texture(m.metallic, v, pool);
+    bake_texture(m.subsurface, v, pool);
+    bake_texture(m.specular, v, pool);
+    bake_texture(m.roughness, v, pool);
+    bake_texture(m.specular_tint, v, pool);
+    bake_texture(m.anisotropic, v, pool);
+    bake_texture(m.sheen, v, pool);
+    bake_texture(m.sheen_tint, v, pool);
+    bake_texture(m.clearcoat, v, pool);
+    bake_texture(m.clearcoat_gloss, v, pool);
+}
+inline Material bake_textures(const Material& mat, const PathVertex& vertex, const TexturePool& pool) {
+    Material baked = mat;
+    std::visit([&](auto& m) { bake_textures(m, vertex, pool); }, baked);
+    return baked;
+}
+
+// photon paths use their own pcg32 stream, selected by the photon index
+constexpr uint64_t c_photon_seed = 0x9e3779b97f4a7c15ULL;
+// number of photon paths traced together by one parallel_for task
+constexpr int64_t c_photon_chunk_size = 4096;
+inline int64_t num_photon_chunks(int64_t num_photons) {
+    return (num_photons + c_photon_chunk_size - 1) / c_photon_chunk_size;
+}
+// radiance photons examined per lookup, and the normal agreement they need
+constexpr size_t c_radiance_lookups = 8;
+constexpr Real c_radiance_min_cos = 0.9;
+
+enum class PhotonTracer {
+    Scalar,     // one photon path at a time
+    Wavefront   // a chunk of paths in SoA queues, intersected in ray packets
+};
+
+enum class PhotonIndex {
+    NanoFlann,  // nanoflann kd-tree over the photon store
+    Balanced,   // Jensen's left-balanced kd-tree, photons stored in heap order
+    HashGrid,   // uniform hash grid, fixed-radius gathers only
+    Simd,       // kd-tree with SoA leaf buckets scanned with AVX2/AVX-512
+    Dynamic     // nanoflann forest that photons can be appended to
+};
+
+enum class GatherMode {
+    KNearest,   // n_neighbors nearest photons
+    Radius,     // every photon within gather_radius
+    Bounded     // n_neighbors nearest photons, but none beyond gather_radius
+};
+
+enum class CameraGather {
+    PerSample,  // gather at every camera sample as it is traced
+    Sorted,     // trace a tile's first hits, then gather them in Z-order
+    Prefetch    // as Sorted, answering the gathers from the tile's candidate photons
+};
+
+struct PhotonMappingOptions {
+    int num_photons = 1000000;
+    int n_neighbors = 500;
+    int max_depth = 10;
+    PhotonTracer tracer = PhotonTracer::Scalar;
+    PhotonIndex index = PhotonIndex::NanoFlann;
+    GatherMode gather = GatherMode::KNearest;
+    float gather_radius = 0.f;  // 0: 1% of the photon bounds diagonal
+    bool morton_sort = true;    // Z-order the photons before building the index
+    CameraGather camera_gather = CameraGather::PerSample;
+    bool radius_hint = true;    // seed camera kNN searches with the previous camera query's radius
+    int radiance_stride = 0;    // >0: precompute irradiance at every stride-th photon
+    float irradiance_error = 0; // >0: irradiance cache with this maximum error (Ward's a)
+    int final_gather_rays = 0;  // >0: final gather with this many BSDF-sampled rays per camera hit
+    int passes = 0;             // >0: progressive photon mapping with this many photon passes
+    float alpha = 0.7f;         // fraction of the new photons kept by a progressive radius update
+    bool stochastic = false;    // progressive passes trace new camera hit points every pass (SPPM)
+    int add_photons = 0;        // >0: append this many photon paths to the dynamic index and render again
+    bool pipeline = false;      // progressive passes trace and index the next passes during the current gathers
+    std::string cache_file;     // non-empty: reuse the photon map stored here, or store it
+    uint64_t scene_hash = 0;    // hash_scene() of the scene, keys the cache file
+};
+
+// first hit of a camera sample, waiting for its photon gather
+struct CameraHit {
+    int x, y;
+    bool hit;
+    PathVertex isect;
+    Vector3 wo;
+    Spectrum radiance;
 };
 
 class PhotonMapping {
     private:
-        int num_photons;
-        int n_neighbors;
-        int max_depth;
+        PhotonMappingOptions options;
         const Scene& scene;
         std::vector<Photon> photon_map;
-        std::vector<Vector3> photon_pos;
+        const Photon* photon_records = nullptr;    // photon_map, or the photons of a mapped cache file
+        MappedFile cache_map;
+        PhotonBounds photon_bounds;
         PhotonKDTree kdtree;
+        BalancedPhotonKDTree balanced_kdtree;
+        PhotonHashGrid hashgrid;
+        SimdPhotonKDTree simd_kdtree;
+        DynamicPhotonKDTree dynamic_kdtree;
+        float gather_radius = 0.f;
+        int64_t num_emitted = 0;   // photon paths traced so far, normalises the estimates
+        int64_t next_photon = 0;   // index of the next photon path add_photons traces
+        // radiance photons: position, facing normal in dir, irradiance in power
+        std::vector<Photon> radiance_map;
+        PhotonBounds radiance_bounds;
+        PhotonKDTree radiance_kdtree;
+        DynamicPhotonKDTree radiance_dynamic_kdtree;   // with the dynamic index, so that add_photons appends sites
+        IrradianceCache irradiance_cache;
     public:
-        PhotonMapping(const int num_photons, const Scene& scene, const int n_neighbors, const int max_depth);
+        PhotonMapping(const Scene& scene, const PhotonMappingOptions& options);
         ~PhotonMapping();
-        std::optional<Ray> bounce_photon(PathVertex isect, Ray photon_ray, 
+        Ray emit_photon(pcg32_state& rng, Spectrum& beta);
+        std::optional<Ray> bounce_photon(const Material& mat, const PathVertex& isect, const Ray& photon_ray, 
             Spectrum& beta, pcg32_state& rng);
-        void store_photon(Vector3 position, Vector3 direction, Spectrum beta);
-        void photon_tracing(pcg32_state& rng);
+        Photon make_photon(const PathVertex& vertex, const Vector3& dir, const Spectrum& power) const;
+        void trace_photon(int64_t index, std::vector<Photon>& photons);
+        void trace_photons(int64_t begin, int64_t end, std::vector<Photon>& photons);
+        void trace_wavefront(int64_t begin, int64_t end, std::vector<Photon>& photons);
+        void photon_tracing(int64_t first_photon = 0);
+        void trace_range(int64_t first_photon, int64_t num_photons);
+        void trace_chunk(int64_t first_photon, int64_t num_photons, int64_t chunk, std::vector<Photon>& photons);
+        void merge_photons(int64_t first_photon, int64_t num_photons, const std::vector<std::vector<Photon>>& buffers);
+        void add_photons(int64_t num_photons);
+        void sort_photons();
         void build_kdtree();
+        uint64_t cache_key() const;
+        bool load_cache();
+        void save_cache() const;
+        float radius() const { return gather_radius; }
+        void precompute_radiance(size_t first_site = 0);
+        bool radiance_lookup(const PathVertex& isect, const Vector3& wo, Spectrum& indirect) const;
+        bool irradiance_lookup(const PathVertex& isect, const Vector3& wo, Spectrum& indirect);
+        void gather_photons(const Vector3& position, PhotonGather& gather, bool camera_query = false) const;
+        void find_nearest(const float query[3], size_t n, PhotonGather& gather,
+                          float max_dist2 = std::numeric_limits<float>::max()) const;
+        template <size_t K>
+        void find_nearest_fixed(const float query[3], PhotonGather& gather, float max_dist2) const;
+        void find_within_radius(const float query[3], float radius, PhotonGather& gather) const;
         Spectrum camera_tracing(int x, int y, pcg32_state& rng);
+        Spectrum photon_estimate(const PathVertex& isect, const Vector3& wo, bool camera_query = true);
+        Spectrum final_gather(const PathVertex& isect, const Vector3& wo, pcg32_state& rng);
+        CameraHit camera_hit(int x, int y, pcg32_state& rng);
+        void gather_hits(std::vector<CameraHit>& hits, pcg32_state& rng);
+        bool prefetch_tile(const std::vector<CameraHit>& hits, TilePhotons& tile) const;
         Spectrum dirct_illumination(PathVertex isect, Vector3 dir_view, pcg32_state& rng);
-        Spectrum indirct_illumination(PathVertex isect, Vector3 wo, std::vector<size_t> neighbors, Real radius2);
+        Spectrum indirct_illumination(const PathVertex& isect, const Vector3& wo, const PhotonGather& gather);
+        Spectrum reflected_flux(const PathVertex& isect, const Vector3& wo, const PhotonGather& gather) const;
 };
\ No newline at end of file
@@ -0,0 +1,198 @@
+#pragma once
+#include "scene.h"
+#include "photon_record.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <variant>
+#include <vector>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// On-disk photon map: a header, then the photon records, the radiance
+// photon sites and, for the nanoflann index, its flattened nodes and leaf
+// order, each section 64-byte aligned. The records are stored in the order
+// of the index they were built for, so the balanced and the nanoflann
+// kd-trees are searched straight from the mapped file.
+constexpr char c_photon_cache_magic[8] = {'P', 'H', 'O', 'T', 'O', 'N', 'M', 'P'};
+constexpr uint32_t c_photon_cache_version = 2;
+
+struct PhotonCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t index;             // PhotonIndex the records are ordered for
+    uint64_t scene_hash;
+    uint64_t params_hash;
+    uint64_t num_emitted;
+    uint64_t num_photons;
+    uint64_t num_sites;
+    uint64_t photon_offset;
+    uint64_t site_offset;
+    uint64_t num_nodes;         // FlatKDNodes of a nanoflann index, 0 for the others
+    uint64_t node_offset;
+    uint64_t order_offset;      // num_photons uint32_t leaf order of a nanoflann index
+    PhotonBounds bounds;
+    float gather_radius;
+};
+
+inline uint64_t align_cache_offset(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+
+// 64-bit FNV-1a, chained through h
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t h = 0xcbf29ce484222325ULL)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+template <typename T>
+inline uint64_t fnv1a(const std::vector<T>& values, uint64_t h)
+{
+    size_t size = values.size();
+    h = fnv1a(&size, sizeof(size), h);
+    return fnv1a(values.data(), size * sizeof(T), h);
+}
+template <typename T>
+inline uint64_t hash_mipmaps(const std::vector<Mipmap<T>>& mipmaps, uint64_t h)
+{
+    // the finest level, the others are filtered from it
+    for (const Mipmap<T>& mipmap : mipmaps) {
+        if (mipmap.images.empty()) continue;
+        const Image<T>& image = mipmap.images[0];
+        int size[2] = {image.width, image.height};
+        h = fnv1a(size, sizeof(size), h);
+        h = fnv1a(image.data, h);
+    }
+    return h;
+}
+
+// hash of the scene file and of everything it loaded: geometry with its
+// shading normals and uvs, and the texture images, so edits to referenced
+// files also invalidate a cached photon map
+inline uint64_t hash_scene(const std::string& filename, const Scene& scene)
+{
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    size_t real_size = sizeof(Real);
+    uint64_t h = fnv1a(&real_size, sizeof(real_size));
+    h = fnv1a(bytes, h);
+    for (const Shape& shape : scene.shapes) {
+        if (const TriangleMesh* mesh = std::get_if<TriangleMesh>(&shape)) {
+            h = fnv1a(mesh->positions, h);
+            h = fnv1a(mesh->indices, h);
+            h = fnv1a(mesh->normals, h);
+            h = fnv1a(mesh->uvs, h);
+        } else if (const Sphere* sphere = std::get_if<Sphere>(&shape)) {
+            h = fnv1a(&sphere->position, sizeof(Vector3), h);
+            h = fnv1a(&sphere->radius, sizeof(Real), h);
+        }
+    }
+    h = hash_mipmaps(scene.texture_pool.image1s, h);
+    h = hash_mipmaps(scene.texture_pool.image3s, h);
+    size_t num_lights = scene.lights.size();
+    return fnv1a(&num_lights, sizeof(num_lights), h);
+}
+
+// temporary file next to path, unique to this process and call, so that
+// processes writing the same cache concurrently never share a file
+inline std::string unique_temp_path(const std::string& path)
+{
+#if defined(_WIN32)
+    int pid = _getpid();
+#else
+    int pid = int(getpid());
+#endif
+    std::random_device random;
+    uint64_t suffix = (uint64_t(random()) << 32) | uint64_t(random());
+    std::ostringstream name;
+    name << path << '.' << pid << '.' << std::hex << suffix << ".tmp";
+    return name.str();
+}
+
+// move from over to in one step, replacing to. processes that have the
+// old file mapped keep their pages. false when to cannot be replaced, e.g.
+// on Windows while another process still maps it.
+inline bool replace_file(const std::string& from, const std::string& to)
+{
+#if defined(_WIN32)
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// read-only memory mapping of a whole file. the pages are shared through
+// the page cache, so several processes rendering the same scene share one copy
+class MappedFile {
+    const char* bytes = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path)
+    {
+        close();
+#if defined(_WIN32)
+        // FILE_SHARE_DELETE lets another process replace the cache while it is open
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) { close(); return false; }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) { close(); return false; }
+        bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!bytes) { close(); return false; }
+        length = size_t(size.QuadPart);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) { ::close(fd); return false; }
+        void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        bytes = static_cast<const char*>(p);
+        length = size_t(st.st_size);
+#endif
+        return true;
+    }
+    void close()
+    {
+#if defined(_WIN32)
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) munmap(const_cast<char*>(bytes), length);
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include "photon_record.h"
+#include "photon_gather.h"
+#include "cpu_features.h"
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// packed power and direction of the photons of one gather, copied out as
+// structure of arrays and padded to 8 lanes with zero power, so that the
+// radiance estimate decodes and sums 8 photons at a time.
+struct PhotonFluxBatch {
+    static constexpr size_t lanes = 8;
+    std::vector<uint32_t> power;
+    std::vector<uint32_t> dir;
+    size_t count = 0;
+
+    void assign(const PhotonGather& gather, const Photon* photons)
+    {
+        count = gather.count;
+        size_t padded = (count + lanes - 1) / lanes * lanes;
+        if (power.size() < padded) {
+            power.resize(padded);
+            dir.resize(padded);
+        }
+        for (size_t i = 0; i < count; i++) {
+            const Photon& p = photons[gather.indices[i]];
+            power[i] = p.power;
+            dir[i] = p.dir;
+        }
+        for (size_t i = count; i < padded; i++) {
+            power[i] = 0;
+            dir[i] = 0;
+        }
+    }
+};
+
+#if defined(PHOTON_MAPPING_X86)
+PHOTON_MAPPING_AVX2 inline float horizontal_sum_avx2(__m256 v)
+{
+    alignas(32) float lane[8];
+    _mm256_store_ps(lane, v);
+    return ((lane[0] + lane[1]) + (lane[2] + lane[3])) + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+}
+// accumulate_flux 8 photons at a time
+PHOTON_MAPPING_AVX2 inline void accumulate_flux_avx2(const PhotonFluxBatch& batch, const float ng[3], const float n[3],
+                                                     float front[3], float back[3])
+{
+    const __m256i byte = _mm256_set1_epi32(0xff);
+    const __m256 one = _mm256_set1_ps(1.f), zero = _mm256_setzero_ps();
+    const __m256 sign_bit = _mm256_set1_ps(-0.f);
+    const __m256 to_unit = _mm256_set1_ps(2.f / 255.f);
+    __m256 ngx = _mm256_set1_ps(ng[0]), ngy = _mm256_set1_ps(ng[1]), ngz = _mm256_set1_ps(ng[2]);
+    __m256 nx = _mm256_set1_ps(n[0]), ny = _mm256_set1_ps(n[1]), nz = _mm256_set1_ps(n[2]);
+    __m256 front_r = zero, front_g = zero, front_b = zero;
+    __m256 back_r = zero, back_g = zero, back_b = zero;
+    for (size_t i = 0; i < batch.count; i += PhotonFluxBatch::lanes) {
+        // RGBE: the scale 2^(e - 136) is built directly in the float
+        // exponent field; exponents that would be denormal decode to zero
+        __m256i p = _mm256_loadu_si256((const __m256i*)(batch.power.data() + i));
+        __m256i e = _mm256_srli_epi32(p, 24);
+        __m256 scale = _mm256_and_ps(_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_sub_epi32(e, _mm256_set1_epi32(9)), 23)),
+                                     _mm256_castsi256_ps(_mm256_cmpgt_epi32(e, _mm256_set1_epi32(9))));
+        __m256 r = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(p, byte)), scale);
+        __m256 g = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 8), byte)), scale);
+        __m256 b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 16), byte)), scale);
+
+        // octahedral direction, folded where z < 0
+        __m256i d = _mm256_loadu_si256((const __m256i*)(batch.dir.data() + i));
+        __m256 x = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(d, byte)), to_unit), one);
+        __m256 y = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(d, 8), byte)), to_unit), one);
+        __m256 ax = _mm256_andnot_ps(sign_bit, x), ay = _mm256_andnot_ps(sign_bit, y);
+        __m256 z = _mm256_sub_ps(_mm256_sub_ps(one, ax), ay);
+        __m256 fold = _mm256_cmp_ps(z, zero, _CMP_LT_OQ);
+        __m256 fx = _mm256_or_ps(_mm256_sub_ps(one, ay), _mm256_and_ps(sign_bit, x));
+        __m256 fy = _mm256_or_ps(_mm256_sub_ps(one, ax), _mm256_and_ps(sign_bit, y));
+        x = _mm256_blendv_ps(x, fx, fold);
+        y = _mm256_blendv_ps(y, fy, fold);
+
+        __m256 cos_ng = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, ngx), _mm256_mul_ps(y, ngy)), _mm256_mul_ps(z, ngz));
+        __m256 cos_n = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, nx), _mm256_mul_ps(y, ny)), _mm256_mul_ps(z, nz));
+        __m256 above = _mm256_cmp_ps(cos_ng, zero, _CMP_GE_OQ);
+        __m256 is_back = _mm256_and_ps(above, _mm256_cmp_ps(cos_n, zero, _CMP_LT_OQ));
+        __m256 is_front = _mm256_andnot_ps(is_back, above);
+        front_r = _mm256_add_ps(front_r, _mm256_and_ps(is_front, r));
+        front_g = _mm256_add_ps(front_g, _mm256_and_ps(is_front, g));
+        front_b = _mm256_add_ps(front_b, _mm256_and_ps(is_front, b));
+        back_r = _mm256_add_ps(back_r, _mm256_and_ps(is_back, r));
+        back_g = _mm256_add_ps(back_g, _mm256_and_ps(is_back, g));
+        back_b = _mm256_add_ps(back_b, _mm256_and_ps(is_back, b));
+    }
+    front[0] = horizontal_sum_avx2(front_r); front[1] = horizontal_sum_avx2(front_g); front[2] = horizontal_sum_avx2(front_b);
+    back[0] = horizontal_sum_avx2(back_r); back[1] = horizontal_sum_avx2(back_g); back[2] = horizontal_sum_avx2(back_b);
+}
+#endif
+
+// sum of the photon powers arriving on the front and on the back side of
+// the shading normal n. photons from below the geometric normal ng are
+// skipped. the directions are only compared by sign, so they are decoded
+// without normalisation. every photon has the same (box) kernel weight.
+inline void accumulate_flux(const PhotonFluxBatch& batch, const float ng[3], const float n[3],
+                            float front[3], float back[3])
+{
+#if defined(PHOTON_MAPPING_X86)
+    if (c_cpu_avx2) {
+        accumulate_flux_avx2(batch, ng, n, front, back);
+        return;
+    }
+#endif
+    for (int c = 0; c < 3; c++) front[c] = back[c] = 0.f;
+    for (size_t i = 0; i < batch.count; i++) {
+        uint32_t p = batch.power[i];
+        int e = int(p >> 24);
+        if (e == 0) continue;
+        float scale = std::ldexp(1.f, e - 136);
+        float x = float(batch.dir[i] & 0xff) * (2.f / 255.f) - 1.f;
+        float y = float((batch.dir[i] >> 8) & 0xff) * (2.f / 255.f) - 1.f;
+        float z = 1.f - std::fabs(x) - std::fabs(y);
+        if (z < 0) {
+            float ox = x;
+            x = std::copysign(1.f - std::fabs(y), ox);
+            y = std::copysign(1.f - std::fabs(ox), y);
+        }
+        if (x * ng[0] + y * ng[1] + z * ng[2] < 0) continue;
+        float* side = x * n[0] + y * n[1] + z * n[2] < 0 ? back : front;
+        side[0] += float(p & 0xff) * scale;
+        side[1] += float((p >> 8) & 0xff) * scale;
+        side[2] += float((p >> 16) & 0xff) * scale;
+    }
+}
\ No newline at end of file
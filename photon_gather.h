@@ -0,0 +1,263 @@
+#pragma once
+#include "photon_record.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// result of one photon gather, kept in per-thread scratch.
+// the arrays grow to their high-water mark and are then reused,
+// so steady-state gathers never touch the allocator.
+struct PhotonGather {
+    std::vector<size_t> indices;
+    std::vector<float> dist2;
+    size_t count = 0;
+    float max_dist2 = 0;
+    float radius_hint2 = 0;     // squared radius of the last camera kNN gather into this scratch
+
+    void reserve(size_t n)
+    {
+        if (indices.size() < n) {
+            indices.resize(n);
+            dist2.resize(n);
+        }
+    }
+};
+
+// bounded max-heap of the k nearest photons, with the worst candidate at
+// the root. photons at or beyond max_dist2 are never accepted, so a search
+// seeded with a radius prunes from the first node.
+// follows nanoflann's result set interface.
+class PhotonKNNHeap {
+    size_t* indices = nullptr;
+    float* dists = nullptr;
+    size_t capacity;
+    size_t count = 0;
+    float bound;
+public:
+    using DistanceType = float;
+    using IndexType = size_t;
+
+    explicit PhotonKNNHeap(size_t capacity, float max_dist2 = std::numeric_limits<float>::max())
+        : capacity(capacity), bound(max_dist2) {}
+
+    void init(size_t* indices_, float* dists_)
+    {
+        indices = indices_;
+        dists = dists_;
+        count = 0;
+    }
+    size_t size() const { return count; }
+    bool full() const { return count == capacity; }
+    float worstDist() const { return full() ? dists[0] : bound; }
+    void sort() {}
+
+    bool addPoint(float dist, size_t index)
+    {
+        if (dist >= bound) return true;
+        if (count < capacity) {
+            // sift up
+            size_t i = count++;
+            while (i > 0) {
+                size_t parent = (i - 1) / 2;
+                if (dists[parent] >= dist) break;
+                dists[i] = dists[parent];
+                indices[i] = indices[parent];
+                i = parent;
+            }
+            dists[i] = dist;
+            indices[i] = index;
+        } else if (count > 0 && dist < dists[0]) {
+            // replace the root and sift down
+            size_t i = 0;
+            for (;;) {
+                size_t child = 2 * i + 1;
+                if (child >= count) break;
+                if (child + 1 < count && dists[child + 1] > dists[child]) child++;
+                if (dists[child] <= dist) break;
+                dists[i] = dists[child];
+                indices[i] = indices[child];
+                i = child;
+            }
+            dists[i] = dist;
+            indices[i] = index;
+        }
+        return true;
+    }
+};
+
+// the same heap with the capacity K fixed at compile time, writing into the
+// caller's gather scratch. the sift-down of a replacement is unrolled level
+// by level, and levels whose children all lie below K need no bound check.
+// the worst distance is kept in a member, so the pruning test reads neither
+// the heap root nor the count.
+template <size_t K>
+class FixedKNNHeap {
+    static_assert(K > 0, "FixedKNNHeap needs a capacity");
+    size_t* indices = nullptr;
+    float* dists = nullptr;
+    size_t count = 0;
+    float worst;
+    float bound;
+
+    // move the hole at node i of Level down to where dist belongs
+    template <size_t Level>
+    size_t sift_down(size_t i, float dist)
+    {
+        constexpr size_t first_child = (size_t(2) << Level) - 1;
+        constexpr size_t last_child = (size_t(4) << Level) - 2;
+        if constexpr (first_child >= K) {
+            return i;
+        } else {
+            size_t child = 2 * i + 1;
+            if constexpr (last_child < K) {
+                child += dists[child + 1] > dists[child];
+            } else {
+                if (child >= K) return i;
+                if (child + 1 < K && dists[child + 1] > dists[child]) child++;
+            }
+            if (dists[child] <= dist) return i;
+            dists[i] = dists[child];
+            indices[i] = indices[child];
+            return sift_down<Level + 1>(child, dist);
+        }
+    }
+public:
+    using DistanceType = float;
+    using IndexType = size_t;
+
+    explicit FixedKNNHeap(float max_dist2 = std::numeric_limits<float>::max())
+        : worst(max_dist2), bound(max_dist2) {}
+
+    // the scratch needs room for K entries
+    void init(size_t* indices_, float* dists_)
+    {
+        indices = indices_;
+        dists = dists_;
+        count = 0;
+        worst = bound;
+    }
+    size_t size() const { return count; }
+    bool full() const { return count == K; }
+    float worstDist() const { return worst; }
+    void sort() {}
+
+    bool addPoint(float dist, size_t index)
+    {
+        if (dist >= worst) return true;
+        size_t i;
+        if (count < K) {
+            // sift up
+            i = count++;
+            while (i > 0) {
+                size_t parent = (i - 1) / 2;
+                if (dists[parent] >= dist) break;
+                dists[i] = dists[parent];
+                indices[i] = indices[parent];
+                i = parent;
+            }
+        } else {
+            i = sift_down<0>(0, dist);
+        }
+        dists[i] = dist;
+        indices[i] = index;
+        if (count == K) worst = dists[0];
+        return true;
+    }
+};
+
+// every photon within a fixed squared radius, appended to the gather
+// scratch. follows nanoflann's result set interface.
+class PhotonRadiusSet {
+    PhotonGather& result;
+    float radius2;
+public:
+    using DistanceType = float;
+    using IndexType = size_t;
+
+    PhotonRadiusSet(PhotonGather& result, float radius2) : result(result), radius2(radius2)
+    {
+        result.count = 0;
+        result.max_dist2 = radius2;
+    }
+    size_t size() const { return result.count; }
+    bool full() const { return true; }
+    float worstDist() const { return radius2; }
+    void sort() {}
+
+    bool addPoint(float dist, size_t index)
+    {
+        if (dist < radius2) {
+            if (result.count == result.indices.size()) result.reserve(std::max(size_t(64), 2 * result.count));
+            result.indices[result.count] = index;
+            result.dist2[result.count] = dist;
+            result.count++;
+        }
+        return true;
+    }
+};
+
+// candidate photons of one camera tile: every photon within radius of
+// center, copied out of the index once so that the per-pixel gathers are
+// answered from a small contiguous buffer.
+struct TilePhotons {
+    float center[3];
+    float radius;
+    std::vector<float> x, y, z, d2;
+    std::vector<size_t> index;
+
+    void assign(const float c[3], float r, const PhotonGather& range, const Photon* photons)
+    {
+        for (int d = 0; d < 3; d++) center[d] = c[d];
+        radius = r;
+        x.resize(range.count); y.resize(range.count); z.resize(range.count);
+        d2.resize(range.count);
+        index.assign(range.indices.begin(), range.indices.begin() + range.count);
+        for (size_t i = 0; i < range.count; i++) {
+            const Photon& p = photons[index[i]];
+            x[i] = p.pos[0]; y[i] = p.pos[1]; z[i] = p.pos[2];
+        }
+    }
+    // distance from q to the edge of the candidate sphere
+    float margin(const float q[3]) const
+    {
+        float dx = q[0] - center[0], dy = q[1] - center[1], dz = q[2] - center[2];
+        return radius - std::sqrt(dx * dx + dy * dy + dz * dz);
+    }
+    template <class RESULTSET>
+    void scan(const float q[3], RESULTSET& rs)
+    {
+        size_t n = x.size();
+        for (size_t i = 0; i < n; i++) {
+            float dx = x[i] - q[0], dy = y[i] - q[1], dz = z[i] - q[2];
+            d2[i] = dx * dx + dy * dy + dz * dz;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (d2[i] < rs.worstDist()) rs.addPoint(d2[i], index[i]);
+        }
+    }
+    // n nearest photons closer than max_dist2; false when they may lie
+    // outside the candidate sphere
+    bool find_nearest(const float q[3], size_t n, PhotonGather& result,
+                      float max_dist2 = std::numeric_limits<float>::max())
+    {
+        float m = margin(q);
+        if (m <= 0) return false;
+        result.reserve(n);
+        PhotonKNNHeap heap(n, std::min(m * m, max_dist2));
+        heap.init(result.indices.data(), result.dist2.data());
+        scan(q, heap);
+        result.count = heap.size();
+        result.max_dist2 = result.count > 0 ? result.dist2[0] : 0.f;
+        return result.count == n || max_dist2 <= m * m;
+    }
+    // every photon within r; false when the query sphere leaves the candidate sphere
+    bool find_within_radius(const float q[3], float r, PhotonGather& result)
+    {
+        if (r > margin(q)) return false;
+        PhotonRadiusSet rs(result, r * r);
+        scan(q, rs);
+        return true;
+    }
+};
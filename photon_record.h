@@ -0,0 +1,94 @@
+#pragma once
+#include "lajolla.h"
+#include "vector.h"
+#include "spectrum.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// octahedral mapping of a unit vector, 8 bits per coordinate
+inline uint16_t encode_octahedral(const Vector3& v) {
+    Real l1 = fabs(v.x) + fabs(v.y) + fabs(v.z);
+    Real x = v.x / l1, y = v.y / l1;
+    if (v.z < 0) {
+        Real ox = x;
+        x = (1 - fabs(y)) * (ox >= 0 ? 1 : -1);
+        y = (1 - fabs(ox)) * (y >= 0 ? 1 : -1);
+    }
+    auto quantize = [](Real a) {
+        return uint16_t(std::lround(std::clamp((a * Real(0.5) + Real(0.5)) * 255, Real(0), Real(255))));
+    };
+    return uint16_t(quantize(x) | (quantize(y) << 8));
+}
+inline Vector3 decode_octahedral(uint16_t e) {
+    Real x = Real(e & 0xff) / 255 * 2 - 1;
+    Real y = Real(e >> 8) / 255 * 2 - 1;
+    Real z = 1 - fabs(x) - fabs(y);
+    if (z < 0) {
+        Real ox = x;
+        x = (1 - fabs(y)) * (ox >= 0 ? 1 : -1);
+        y = (1 - fabs(ox)) * (y >= 0 ? 1 : -1);
+    }
+    return normalize(Vector3{x, y, z});
+}
+
+// shared exponent (RGBE) encoding of a non-negative spectrum
+inline uint32_t encode_rgbe(const Spectrum& s) {
+    Real m = max(s);
+    if (!(m > Real(1e-32))) return 0;
+    int e;
+    std::frexp(m, &e);
+    Real scale = std::ldexp(Real(1), 8 - e);
+    auto quantize = [scale](Real a) {
+        return uint32_t(std::clamp(std::lround(a * scale), long(0), long(255)));
+    };
+    return quantize(s.x) | (quantize(s.y) << 8) | (quantize(s.z) << 16) | (uint32_t(e + 128) << 24);
+}
+inline Spectrum decode_rgbe(uint32_t c) {
+    if ((c >> 24) == 0) return make_zero_spectrum();
+    Real scale = std::ldexp(Real(1), int(c >> 24) - (128 + 8));
+    return Spectrum{Real(c & 0xff) * scale, Real((c >> 8) & 0xff) * scale, Real((c >> 16) & 0xff) * scale};
+}
+
+// 20 byte photon: float position, RGBE power, octahedral incoming direction
+struct Photon {
+    float pos[3];
+    uint32_t power;
+    uint16_t dir;
+    uint16_t flag;      // octahedral surface normal while tracing, splitting axis in the balanced kd-tree
+
+    Photon() = default;
+    Photon(const Vector3& position, const Vector3& direction, const Spectrum& energy)
+        : pos{float(position.x), float(position.y), float(position.z)},
+          power(encode_rgbe(energy)), dir(encode_octahedral(direction)), flag(0) {}
+
+    Vector3 position() const { return Vector3{pos[0], pos[1], pos[2]}; }
+    Vector3 direction() const { return decode_octahedral(dir); }
+    Spectrum energy() const { return decode_rgbe(power); }
+};
+static_assert(sizeof(Photon) == 20, "Photon is expected to be tightly packed");
+
+// axis-aligned bounds of a set of photon positions
+struct PhotonBounds {
+    float lo[3] = { infinity<float>(), infinity<float>(), infinity<float>() };
+    float hi[3] = { -infinity<float>(), -infinity<float>(), -infinity<float>() };
+
+    void expand(const Photon& p) {
+        for (int d = 0; d < 3; d++) {
+            lo[d] = std::min(lo[d], p.pos[d]);
+            hi[d] = std::max(hi[d], p.pos[d]);
+        }
+    }
+    void expand(const Vector3& p) {
+        for (int d = 0; d < 3; d++) {
+            lo[d] = std::min(lo[d], float(p[d]));
+            hi[d] = std::max(hi[d], float(p[d]));
+        }
+    }
+    void expand(const PhotonBounds& b) {
+        for (int d = 0; d < 3; d++) {
+            lo[d] = std::min(lo[d], b.lo[d]);
+            hi[d] = std::max(hi[d], b.hi[d]);
+        }
+    }
+};
@@ -0,0 +1,185 @@
+#pragma once
+#include "photon.h"
+#include <embree4/rtcore.h>
+
+// Photon paths in flight, stored as structure of arrays so that a chunk of
+// paths can be intersected in packets and shaded in batches per material.
+struct PhotonPaths {
+    std::vector<Real> org_x, org_y, org_z;
+    std::vector<Real> dir_x, dir_y, dir_z;
+    std::vector<Real> tnear;
+    std::vector<Spectrum> beta;
+    std::vector<Spectrum> throughput;
+    std::vector<pcg32_state> rng;
+    std::vector<PathVertex> vertex;
+    std::vector<uint8_t> hit;
+
+    void resize(size_t n) {
+        org_x.resize(n); org_y.resize(n); org_z.resize(n);
+        dir_x.resize(n); dir_y.resize(n); dir_z.resize(n);
+        tnear.resize(n);
+        beta.resize(n);
+        throughput.resize(n);
+        rng.resize(n);
+        vertex.resize(n);
+        hit.resize(n);
+    }
+    Ray ray(size_t i) const {
+        return Ray{Vector3{org_x[i], org_y[i], org_z[i]},
+                   Vector3{dir_x[i], dir_y[i], dir_z[i]}, tnear[i], infinity<Real>()};
+    }
+    void set_ray(size_t i, const Ray& ray) {
+        org_x[i] = ray.org.x; org_y[i] = ray.org.y; org_z[i] = ray.org.z;
+        dir_x[i] = ray.dir.x; dir_y[i] = ray.dir.y; dir_z[i] = ray.dir.z;
+        tnear[i] = ray.tnear;
+    }
+    // compaction: copy path src into slot dst
+    void move(size_t dst, size_t src) {
+        org_x[dst] = org_x[src]; org_y[dst] = org_y[src]; org_z[dst] = org_z[src];
+        dir_x[dst] = dir_x[src]; dir_y[dst] = dir_y[src]; dir_z[dst] = dir_z[src];
+        tnear[dst] = tnear[src];
+        beta[dst] = beta[src];
+        throughput[dst] = throughput[src];
+        rng[dst] = rng[src];
+    }
+};
+
+// same surface point lajolla's intersect() builds from a single-ray hit
+PathVertex make_packet_vertex(const Scene& scene, const Ray& ray, const RTCRayHit8& rayhit, int k) {
+    PathVertex vertex;
+    vertex.position = ray.org + ray.dir * Real(rayhit.ray.tfar[k]);
+    vertex.geometric_normal = normalize(Vector3{rayhit.hit.Ng_x[k], rayhit.hit.Ng_y[k], rayhit.hit.Ng_z[k]});
+    vertex.shape_id = rayhit.hit.geomID[k];
+    vertex.primitive_id = rayhit.hit.primID[k];
+    const Shape& shape = scene.shapes[vertex.shape_id];
+    vertex.material_id = get_material_id(shape);
+    vertex.interior_medium_id = get_interior_medium_id(shape);
+    vertex.exterior_medium_id = get_exterior_medium_id(shape);
+    vertex.st = Vector2{rayhit.hit.u[k], rayhit.hit.v[k]};
+    ShadingInfo shading_info = compute_shading_info(shape, vertex);
+    vertex.shading_frame = shading_info.shading_frame;
+    vertex.uv = shading_info.uv;
+    vertex.mean_curvature = shading_info.mean_curvature;
+    // photon rays carry no ray differentials
+    vertex.ray_radius = 0;
+    vertex.uv_screen_size = 0;
+    if (dot(vertex.geometric_normal, vertex.shading_frame.n) < 0) {
+        vertex.geometric_normal = -vertex.geometric_normal;
+    }
+    return vertex;
+}
+
+// intersect the first count paths, 8 rays per embree packet
+void intersect_packets(const Scene& scene, PhotonPaths& paths, size_t count) {
+    for (size_t base = 0; base < count; base += 8) {
+        int n = int(std::min(count - base, size_t(8)));
+        alignas(32) int valid[8];
+        RTCRayHit8 rayhit;
+        for (int k = 0; k < 8; k++) {
+            // inactive lanes replicate the first ray and are masked out
+            size_t i = base + (k < n ? k : 0);
+            valid[k] = k < n ? -1 : 0;
+            rayhit.ray.org_x[k] = float(paths.org_x[i]);
+            rayhit.ray.org_y[k] = float(paths.org_y[i]);
+            rayhit.ray.org_z[k] = float(paths.org_z[i]);
+            rayhit.ray.dir_x[k] = float(paths.dir_x[i]);
+            rayhit.ray.dir_y[k] = float(paths.dir_y[i]);
+            rayhit.ray.dir_z[k] = float(paths.dir_z[i]);
+            rayhit.ray.tnear[k] = float(paths.tnear[i]);
+            rayhit.ray.tfar[k] = infinity<float>();
+            rayhit.ray.time[k] = 0.f;
+            rayhit.ray.mask[k] = unsigned(-1);
+            rayhit.ray.id[k] = unsigned(k);
+            rayhit.ray.flags[k] = 0;
+            rayhit.hit.geomID[k] = RTC_INVALID_GEOMETRY_ID;
+            rayhit.hit.instID[0][k] = RTC_INVALID_GEOMETRY_ID;
+        }
+        rtcIntersect8(valid, scene.embree_scene, &rayhit);
+        for (int k = 0; k < n; k++) {
+            size_t i = base + k;
+            paths.hit[i] = rayhit.hit.geomID[k] != RTC_INVALID_GEOMETRY_ID;
+            if (paths.hit[i]) paths.vertex[i] = make_packet_vertex(scene, paths.ray(i), rayhit, k);
+        }
+    }
+}
+
+
+
+///------------------------------ Wavefront Photon Tracing ------------------------------------///
+void PhotonMapping::trace_wavefront(int64_t begin, int64_t end, std::vector<Photon>& photons){
+    size_t count = size_t(end - begin);
+    PhotonPaths paths;
+    paths.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        paths.rng[i] = init_pcg32(uint64_t(begin + i), c_photon_seed);
+        paths.set_ray(i, emit_photon(paths.rng[i], paths.beta[i]));
+        paths.throughput[i] = make_const_spectrum(1.0);
+    }
+
+    // lajolla's sphere callbacks only handle single rays
+    bool use_packets = std::none_of(scene.shapes.begin(), scene.shapes.end(),
+        [](const Shape& shape) { return std::holds_alternative<Sphere>(shape); });
+
+    size_t num_materials = scene.materials.size();
+    std::vector<size_t> material_start(num_materials + 1);
+    std::vector<size_t> order(count);
+    std::vector<uint8_t> alive(count);
+    for (int bounce = 0; bounce < options.max_depth && count > 0; bounce++) {
+        // intersect every path in flight
+        if (use_packets) {
+            intersect_packets(scene, paths, count);
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                std::optional<PathVertex> vertex_ = intersect(scene, paths.ray(i));
+                paths.hit[i] = bool(vertex_);
+                if (vertex_) paths.vertex[i] = *vertex_;
+            }
+        }
+
+        // store photons and bucket the surviving paths by material
+        std::fill(material_start.begin(), material_start.end(), 0);
+        for (size_t i = 0; i < count; i++) {
+            alive[i] = paths.hit[i] && !is_light(scene.shapes[paths.vertex[i].shape_id]);
+            if (!alive[i]) continue;
+            if(bounce >= 1) //TODO for only indirect illumination
+                photons.push_back(make_photon(paths.vertex[i], -paths.ray(i).dir,
+                                              paths.beta[i] * paths.throughput[i]));
+            material_start[paths.vertex[i].material_id + 1]++;
+        }
+        for (size_t m = 0; m < num_materials; m++) material_start[m + 1] += material_start[m];
+        for (size_t i = 0; i < count; i++) {
+            if (alive[i]) order[material_start[paths.vertex[i].material_id]++] = i;
+        }
+        for (size_t m = num_materials; m > 0; m--) material_start[m] = material_start[m - 1];
+        material_start[0] = 0;
+
+        // sample the BSDFs one material at a time
+        for (size_t m = 0; m < num_materials; m++) {
+            const Material& mat = scene.materials[m];
+            for (size_t j = material_start[m]; j < material_start[m + 1]; j++) {
+                size_t i = order[j];
+                std::optional<Ray> reflected_ray = bounce_photon(mat, paths.vertex[i], paths.ray(i),
+                                                                 paths.throughput[i], paths.rng[i]);
+                if (!reflected_ray) {alive[i] = 0; continue;}
+                paths.set_ray(i, *reflected_ray);
+
+                //Russian roulete
+                if(bounce > 1){
+                    Real rr_prob = min(max(paths.throughput[i]), 0.95);
+                    Real rand = next_pcg32_real<Real>(paths.rng[i]);
+                    if (rand >= rr_prob) alive[i] = 0;
+                    else paths.throughput[i] /= rr_prob;
+                }
+            }
+        }
+
+        // compact the terminated paths away
+        size_t num_alive = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!alive[i]) continue;
+            if (num_alive != i) paths.move(num_alive, i);
+            num_alive++;
+        }
+        count = num_alive;
+    }
+}
@@ -0,0 +1,373 @@
+#pragma once
+#include "progressive.h"
+#include "progress_reporter.h"
+#include <memory>
+
+// the progressive passes read the photons directly with radius gathers
+static PhotonMappingOptions progressive_options(const PhotonMappingOptions& options) {
+    PhotonMappingOptions pass_options = options;
+    pass_options.gather = GatherMode::Radius;
+    pass_options.radiance_stride = 0;
+    pass_options.irradiance_error = 0;
+    pass_options.final_gather_rays = 0;
+    return pass_options;
+}
+
+// refine the chunk-th c_photon_chunk_size hit points with the photons of one pass
+static void gather_chunk(const PhotonMapping& pm, std::vector<HitPoint>& hit_points, Real alpha, int64_t chunk) {
+    thread_local PhotonGather gather;
+    int64_t end = std::min((chunk + 1) * c_photon_chunk_size, int64_t(hit_points.size()));
+    for (int64_t i = chunk * c_photon_chunk_size; i < end; i++) {
+        HitPoint& hp = hit_points[i];
+        if (!hp.hit || hp.radius2 <= 0) continue;
+        const Vector3& p = hp.isect.position;
+        float query[3] = {float(p.x), float(p.y), float(p.z)};
+        pm.find_within_radius(query, float(sqrt(hp.radius2)), gather);
+        if (gather.count == 0) continue;
+
+        // keep alpha of the new photons and shrink the radius to match
+        Real m = Real(gather.count);
+        Real n = hp.n + alpha * m;
+        Real ratio = n / (hp.n + m);
+        hp.flux = (hp.flux + pm.reflected_flux(hp.isect, hp.wo, gather)) * ratio;
+        hp.radius2 *= ratio;
+        hp.n = n;
+    }
+}
+
+// one more direct lighting sample for the hit points of image row y
+static void direct_row(PhotonMapping& pm, std::vector<HitPoint>& hit_points, size_t row_size, int64_t y, int pass) {
+    pcg32_state rng = init_pcg32(y, uint64_t(pass));
+    for (size_t i = size_t(y) * row_size; i < size_t(y + 1) * row_size; i++) {
+        HitPoint& hp = hit_points[i];
+        if (hp.hit) hp.direct += pm.dirct_illumination(hp.isect, hp.wo, rng);
+    }
+}
+
+Image3 ppm_render(const Scene& scene, const PhotonMappingOptions& options) {
+    const int w = scene.camera.width,
+              h = scene.camera.height;
+    const int spp = scene.options.samples_per_pixel;
+    Image3 img(w, h);
+
+    PhotonMappingOptions pass_options = progressive_options(options);
+
+    // hit points, one per pixel sample, with the first direct lighting sample
+    std::vector<HitPoint> hit_points(size_t(w) * h * spp);
+    {
+        PhotonMapping camera(scene, pass_options);
+        parallel_for([&](int64_t y) {
+            pcg32_state rng = init_pcg32(y);
+            for (int x = 0; x < w; x++) {
+                for (int s = 0; s < spp; s++) {
+                    HitPoint& hp = hit_points[(size_t(y) * w + x) * spp + s];
+                    CameraHit hit = camera.camera_hit(x, int(y), rng);
+                    hp.hit = hit.hit && !is_light(scene.shapes[hit.isect.shape_id]);
+                    hp.isect = hit.isect;
+                    hp.wo = hit.wo;
+                    hp.direct = hit.radiance;
+                    hp.flux = make_zero_spectrum();
+                }
+            }
+        }, h);
+    }
+
+    // photon map of one pass from its traced chunks. later passes keep the
+    // first pass's radius, the hash grid cells depend on it
+    const int64_t num_trace_chunks = num_photon_chunks(options.num_photons);
+    const int64_t num_gather_chunks = num_photon_chunks(int64_t(hit_points.size()));
+    auto index_pass = [&](int pass, const std::vector<std::vector<Photon>>& buffers) {
+        auto pm = std::make_unique<PhotonMapping>(scene, pass_options);
+        pm->merge_photons(int64_t(pass) * options.num_photons, options.num_photons, buffers);
+        pm->sort_photons();
+        pm->build_kdtree();
+        if (pass == 0) pass_options.gather_radius = pm->radius();
+        return pm;
+    };
+    auto set_initial_radius = [&](const PhotonMapping& pm) {
+        Real radius2 = Real(pm.radius()) * Real(pm.radius());
+        for (HitPoint& hp : hit_points) hp.radius2 = radius2;
+    };
+    ProgressReporter reporter(options.passes);
+
+    if (!options.pipeline) {
+        for (int pass = 0; pass < options.passes; pass++) {
+            PhotonMapping pm(scene, pass_options);
+            pm.photon_tracing(int64_t(pass) * options.num_photons);
+            pm.sort_photons();
+            pm.build_kdtree();
+            if (pass == 0) {
+                pass_options.gather_radius = pm.radius();
+                set_initial_radius(pm);
+            }
+            parallel_for([&](int64_t chunk) {
+                gather_chunk(pm, hit_points, options.alpha, chunk);
+            }, num_gather_chunks);
+            if (pass > 0) {
+                parallel_for([&](int64_t y) {
+                    direct_row(pm, hit_points, size_t(w) * spp, y, pass);
+                }, h);
+            }
+            reporter.update(1);
+        }
+    } else {
+        // every pass is one parallel_for whose tasks index the next pass's
+        // photon map, gather and light the current pass and trace the photon
+        // paths of the pass after next, so the cores stay busy across the
+        // pass barriers. the index build is task 0, the longest serial one.
+        // two passes of traced chunk buffers alternate and keep their capacity.
+        PhotonMapping tracer(scene, pass_options);
+        std::vector<std::vector<Photon>> traced(num_trace_chunks), tracing(num_trace_chunks);
+        parallel_for([&](int64_t task) {
+            int64_t pass = task / num_trace_chunks;
+            std::vector<Photon>& buffer = pass == 0 ? tracing[task % num_trace_chunks] : traced[task % num_trace_chunks];
+            tracer.trace_chunk(pass * options.num_photons, options.num_photons, task % num_trace_chunks, buffer);
+        }, std::min(options.passes, 2) * num_trace_chunks);
+        std::unique_ptr<PhotonMapping> map;
+        if (options.passes > 0) {
+            map = index_pass(0, tracing);
+            set_initial_radius(*map);
+        }
+
+        for (int pass = 0; pass < options.passes; pass++) {
+            std::unique_ptr<PhotonMapping> next;
+            int64_t num_index = pass + 1 < options.passes ? 1 : 0;
+            int64_t num_direct = pass > 0 ? h : 0;
+            int64_t num_trace = pass + 2 < options.passes ? num_trace_chunks : 0;
+            int64_t trace_pass = int64_t(pass + 2);
+            parallel_for([&](int64_t task) {
+                if (task < num_index) {
+                    next = index_pass(pass + 1, traced);
+                    return;
+                }
+                task -= num_index;
+                if (task < num_gather_chunks) {
+                    gather_chunk(*map, hit_points, options.alpha, task);
+                    return;
+                }
+                task -= num_gather_chunks;
+                if (task < num_direct) {
+                    direct_row(*map, hit_points, size_t(w) * spp, task, pass);
+                    return;
+                }
+                task -= num_direct;
+                tracer.trace_chunk(trace_pass * options.num_photons, options.num_photons, task, tracing[task]);
+            }, num_index + num_gather_chunks + num_direct + num_trace);
+            map = std::move(next);
+            std::swap(traced, tracing);
+            reporter.update(1);
+        }
+    }
+    reporter.done();
+
+    // radiance = direct + flux / (pi r^2 * number of emitted photons)
+    Real num_emitted = Real(options.passes) * Real(options.num_photons);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            Spectrum radiance = make_zero_spectrum();
+            for (int s = 0; s < spp; s++) {
+                const HitPoint& hp = hit_points[(size_t(y) * w + x) * spp + s];
+                if (!hp.hit) {
+                    radiance += hp.direct;
+                    continue;
+                }
+                radiance += hp.direct / Real(std::max(options.passes, 1));
+                if (hp.radius2 > 0) radiance += hp.flux / (c_PI * hp.radius2 * num_emitted);
+            }
+            img(x, y) = radiance / Real(spp);
+        }
+    }
+    return img;
+}
+
+// per-pixel state of stochastic progressive photon mapping. the visible
+// point is replaced every pass, the radius, count and flux persist
+struct SPPMPixel {
+    bool hit = false;
+    PathVertex isect;
+    Vector3 wo;
+    Spectrum direct = make_zero_spectrum();
+    Real radius2 = 0;
+    Real n = 0;
+    Spectrum flux = make_zero_spectrum();
+    // photons splatted during the current pass
+    std::atomic<float> phi[3] = {0.f, 0.f, 0.f};
+    std::atomic<int> m{0};
+};
+
+static void atomic_add(std::atomic<float>& a, float v) {
+    float old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) {}
+}
+
+// hash grid over the visible points of one pass, filled in parallel. each
+// bucket is a lock-free linked list of entries pointing at pixels, and a
+// visible point is linked into every cell its radius overlaps. the cells
+// are twice the largest radius, so that is at most 8 cells.
+struct VisiblePointGrid {
+    float lo[3];
+    float inv_cell_size;
+    size_t mask;
+    std::vector<std::atomic<int32_t>> heads;
+    std::vector<int32_t> next;
+    std::vector<uint32_t> pixel;
+    std::atomic<int32_t> num_entries{0};
+
+    int cell(float p, int d) const { return int(std::floor((p - lo[d]) * inv_cell_size)); }
+
+    void build(std::vector<SPPMPixel>& pixels) {
+        // bounds and largest radius of the visible points
+        PhotonBounds bounds;
+        Real max_radius2 = 0;
+        for (const SPPMPixel& px : pixels) {
+            if (!px.hit) continue;
+            bounds.expand(px.isect.position);
+            max_radius2 = std::max(max_radius2, px.radius2);
+        }
+        heads.clear();
+        if (max_radius2 <= 0) return;
+        for (int d = 0; d < 3; d++) lo[d] = bounds.lo[d];
+        inv_cell_size = float(1 / (2 * sqrt(max_radius2)));
+        size_t table_size = 1;
+        while (table_size < pixels.size()) table_size <<= 1;
+        mask = table_size - 1;
+        heads = std::vector<std::atomic<int32_t>>(table_size);
+        for (std::atomic<int32_t>& head : heads) head.store(-1, std::memory_order_relaxed);
+        next.resize(8 * pixels.size());
+        pixel.resize(8 * pixels.size());
+        num_entries = 0;
+
+        int64_t num_pixels = int64_t(pixels.size());
+        int64_t num_chunks = (num_pixels + c_photon_chunk_size - 1) / c_photon_chunk_size;
+        parallel_for([&](int64_t chunk) {
+            int64_t end = std::min((chunk + 1) * c_photon_chunk_size, num_pixels);
+            for (int64_t i = chunk * c_photon_chunk_size; i < end; i++) {
+                const SPPMPixel& px = pixels[i];
+                if (!px.hit) continue;
+                float r = float(sqrt(px.radius2));
+                int c_lo[3], c_hi[3];
+                for (int d = 0; d < 3; d++) {
+                    c_lo[d] = cell(float(px.isect.position[d]) - r, d);
+                    c_hi[d] = cell(float(px.isect.position[d]) + r, d);
+                }
+                // cells can share a bucket, link each bucket once
+                size_t visited[8];
+                int num_visited = 0;
+                for (int z = c_lo[2]; z <= c_hi[2]; z++) for (int y = c_lo[1]; y <= c_hi[1]; y++) for (int x = c_lo[0]; x <= c_hi[0]; x++) {
+                    size_t bucket = spatial_hash(x, y, z) & mask;
+                    bool seen = false;
+                    for (int k = 0; k < num_visited; k++) seen |= visited[k] == bucket;
+                    if (seen || num_visited == 8) continue;     // more than 8 only through float rounding
+                    visited[num_visited++] = bucket;
+                    int32_t entry = num_entries.fetch_add(1, std::memory_order_relaxed);
+                    pixel[entry] = uint32_t(i);
+                    next[entry] = heads[bucket].exchange(entry, std::memory_order_acq_rel);
+                }
+            }
+        }, num_chunks);
+    }
+    template <typename F>
+    void for_each(const float p[3], F f) const {
+        if (heads.empty()) return;
+        int32_t entry = heads[spatial_hash(cell(p[0], 0), cell(p[1], 1), cell(p[2], 2)) & mask].load(std::memory_order_acquire);
+        for (; entry >= 0; entry = next[entry]) f(pixel[entry]);
+    }
+};
+
+Image3 sppm_render(const Scene& scene, const PhotonMappingOptions& options) {
+    const int w = scene.camera.width,
+              h = scene.camera.height;
+    Image3 img(w, h);
+    std::vector<SPPMPixel> pixels(size_t(w) * h);
+    PhotonMapping pm(scene, progressive_options(options));
+    VisiblePointGrid grid;
+
+    ProgressReporter reporter(options.passes);
+    for (int pass = 0; pass < options.passes; pass++) {
+        // new visible point and direct lighting sample per pixel
+        parallel_for([&](int64_t y) {
+            pcg32_state rng = init_pcg32(y, uint64_t(pass));
+            for (int x = 0; x < w; x++) {
+                SPPMPixel& px = pixels[size_t(y) * w + x];
+                CameraHit hit = pm.camera_hit(x, int(y), rng);
+                px.direct += hit.radiance;
+                px.hit = hit.hit && !is_light(scene.shapes[hit.isect.shape_id]);
+                px.isect = hit.isect;
+                px.wo = hit.wo;
+            }
+        }, h);
+        if (pass == 0) {
+            // initial radius: as the photon map's, relative to the visible points
+            PhotonBounds bounds;
+            for (const SPPMPixel& px : pixels) {
+                if (px.hit) bounds.expand(px.isect.position);
+            }
+            Real radius = options.gather_radius;
+            if (radius <= 0) {
+                Real dx = bounds.hi[0] - bounds.lo[0], dy = bounds.hi[1] - bounds.lo[1], dz = bounds.hi[2] - bounds.lo[2];
+                radius = Real(0.01) * sqrt(dx * dx + dy * dy + dz * dz);
+            }
+            for (SPPMPixel& px : pixels) px.radius2 = radius * radius;
+        }
+        grid.build(pixels);
+
+        // trace the pass's photons in chunks and splat them into the visible points
+        int64_t first_photon = int64_t(pass) * options.num_photons;
+        int64_t num_chunks = (int64_t(options.num_photons) + c_photon_chunk_size - 1) / c_photon_chunk_size;
+        parallel_for([&](int64_t chunk) {
+            thread_local std::vector<Photon> photons;
+            photons.clear();
+            int64_t begin = first_photon + chunk * c_photon_chunk_size;
+            int64_t end = std::min(begin + c_photon_chunk_size, first_photon + options.num_photons);
+            pm.trace_photons(begin, end, photons);
+            for (const Photon& photon : photons) {
+                Vector3 position = photon.position();
+                Vector3 dir = photon.direction();
+                Spectrum power = photon.energy();
+                grid.for_each(photon.pos, [&](uint32_t i) {
+                    SPPMPixel& px = pixels[i];
+                    if (distance_squared(px.isect.position, position) >= px.radius2) return;
+                    // same BSDF weight and cosine cancellation as reflected_flux
+                    const Material& mat = scene.materials[px.isect.material_id];
+                    Spectrum f = eval(mat, dir, px.wo, px.isect, scene.texture_pool, TransportDirection::TO_VIEW);
+                    Vector3 n = px.isect.shading_frame.n;
+                    Real cosine = fmax(dot(n, dir) < 0 ? -dot(n, px.wo) : dot(n, px.wo), Real(0));
+                    if (cosine > 0.0001) f /= cosine;
+                    Spectrum phi = power * f;
+                    for (int c = 0; c < 3; c++) atomic_add(px.phi[c], float(phi[c]));
+                    px.m.fetch_add(1, std::memory_order_relaxed);
+                });
+            }
+        }, num_chunks);
+
+        // progressive radius and flux update
+        parallel_for([&](int64_t y) {
+            for (int x = 0; x < w; x++) {
+                SPPMPixel& px = pixels[size_t(y) * w + x];
+                int m = px.m.exchange(0, std::memory_order_relaxed);
+                Spectrum phi{px.phi[0].exchange(0.f), px.phi[1].exchange(0.f), px.phi[2].exchange(0.f)};
+                if (m == 0) continue;
+                Real n = px.n + options.alpha * m;
+                Real ratio = n / (px.n + m);
+                px.flux = (px.flux + phi) * ratio;
+                px.radius2 *= ratio;
+                px.n = n;
+            }
+        }, h);
+        reporter.update(1);
+    }
+    reporter.done();
+
+    // radiance = direct + flux / (pi r^2 * number of emitted photons)
+    Real num_passes = Real(std::max(options.passes, 1));
+    Real num_emitted = num_passes * Real(options.num_photons);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const SPPMPixel& px = pixels[size_t(y) * w + x];
+            Spectrum radiance = px.direct / num_passes;
+            if (px.radius2 > 0) radiance += px.flux / (c_PI * px.radius2 * num_emitted);
+            img(x, y) = radiance;
+        }
+    }
+    return img;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "photon.h"
+#include "image.h"
+#include <atomic>
+
+// camera hit point of progressive photon mapping. the radius, photon
+// count and flux are refined pass by pass (Hachisuka et al. 2008), so the
+// photons of a pass can be discarded once it has been gathered.
+struct HitPoint {
+    bool hit = false;
+    PathVertex isect;
+    Vector3 wo;
+    Spectrum direct;        // sum of one direct lighting sample per pass
+    Real radius2 = 0;       // current squared gather radius
+    Real n = 0;             // accumulated photon count
+    Spectrum flux;          // accumulated reflected photon power inside radius2
+};
+
+// progressive photon mapping: the hit points are traced once, then
+// options.passes passes of options.num_photons photons are gathered into them
+Image3 ppm_render(const Scene& scene, const PhotonMappingOptions& options);
+
+// stochastic progressive photon mapping (Hachisuka and Jensen 2009): every
+// pass traces one new visible point per pixel, hashes the visible points
+// into a grid and splats the pass's photons straight into them
+Image3 sppm_render(const Scene& scene, const PhotonMappingOptions& options);
@@ -0,0 +1,184 @@
+#pragma once
+#include "photon_record.h"
+#include "photon_gather.h"
+#include "cpu_features.h"
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+// kd-tree with SoA leaf buckets for vectorised kNN. The photons are
+// reordered so that every leaf is a contiguous range of the store, and the
+// leaf positions are copied into x[], y[], z[] padded to 16 lanes, so a leaf
+// is scanned 8 (AVX2) or 16 (AVX-512) squared distances at a time. Only
+// lanes under the current bound are pushed into the result set. The AVX2
+// scan is picked at run time; AVX-512 is used when the compiler targets it.
+class SimdPhotonKDTree {
+    static constexpr uint32_t leaf_size = 32;
+    static constexpr uint32_t lanes = 16;
+    static constexpr uint32_t leaf_axis = 3;
+
+    struct Node {
+        float split;
+        uint32_t axis;      // leaf_axis for leaves
+        uint32_t right;     // inner: right child (left child is the next node); leaf: first photon
+        uint32_t count;     // leaf: number of photons
+        uint32_t soa;       // leaf: offset into x, y, z
+    };
+    std::vector<Node> nodes;
+    std::vector<float> x, y, z;
+
+    static int lowest_bit(uint32_t mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long i;
+        _BitScanForward(&i, mask);
+        return int(i);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+    uint32_t build_node(std::vector<Photon>& store, uint32_t begin, uint32_t end)
+    {
+        uint32_t node = uint32_t(nodes.size());
+        nodes.push_back(Node{});
+        PhotonBounds bounds;
+        for (uint32_t i = begin; i < end; i++) bounds.expand(store[i]);
+        if (end - begin <= leaf_size) {
+            uint32_t soa = uint32_t(x.size());
+            uint32_t padded = (end - begin + lanes - 1) / lanes * lanes;
+            // padding lanes sit at infinity and never pass the distance test
+            x.resize(soa + padded, infinity<float>());
+            y.resize(soa + padded, infinity<float>());
+            z.resize(soa + padded, infinity<float>());
+            for (uint32_t i = begin; i < end; i++) {
+                x[soa + i - begin] = store[i].pos[0];
+                y[soa + i - begin] = store[i].pos[1];
+                z[soa + i - begin] = store[i].pos[2];
+            }
+            nodes[node] = Node{0.f, leaf_axis, begin, end - begin, soa};
+            return node;
+        }
+        uint32_t axis = 0;
+        for (uint32_t d = 1; d < 3; d++) {
+            if (bounds.hi[d] - bounds.lo[d] > bounds.hi[axis] - bounds.lo[axis]) axis = d;
+        }
+        uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(store.begin() + begin, store.begin() + mid, store.begin() + end,
+            [axis](const Photon& a, const Photon& b) { return a.pos[axis] < b.pos[axis]; });
+        float split = store[mid].pos[axis];
+        build_node(store, begin, mid);
+        uint32_t right = build_node(store, mid, end);
+        nodes[node] = Node{split, axis, right, 0, 0};
+        return node;
+    }
+#if defined(PHOTON_MAPPING_X86)
+    template <class RESULTSET>
+    PHOTON_MAPPING_AVX2 void scan_leaf_avx2(const Node& leaf, const float q[3], RESULTSET& rs) const
+    {
+        const float* xs = x.data() + leaf.soa;
+        const float* ys = y.data() + leaf.soa;
+        const float* zs = z.data() + leaf.soa;
+        __m256 qx = _mm256_set1_ps(q[0]), qy = _mm256_set1_ps(q[1]), qz = _mm256_set1_ps(q[2]);
+        for (uint32_t i = 0; i < leaf.count; i += 8) {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + i), qx);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + i), qy);
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(zs + i), qz);
+            __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                                      _mm256_mul_ps(dz, dz));
+            uint32_t mask = uint32_t(_mm256_movemask_ps(
+                _mm256_cmp_ps(d2, _mm256_set1_ps(rs.worstDist()), _CMP_LT_OQ)));
+            if (!mask) continue;
+            alignas(32) float d[8];
+            _mm256_store_ps(d, d2);
+            for (; mask; mask &= mask - 1) {
+                int k = lowest_bit(mask);
+                if (d[k] < rs.worstDist()) rs.addPoint(d[k], leaf.right + i + k);
+            }
+        }
+    }
+#endif
+    template <class RESULTSET>
+    void scan_leaf(const Node& leaf, const float q[3], RESULTSET& rs) const
+    {
+#if defined(__AVX512F__)
+        const float* xs = x.data() + leaf.soa;
+        const float* ys = y.data() + leaf.soa;
+        const float* zs = z.data() + leaf.soa;
+        __m512 qx = _mm512_set1_ps(q[0]), qy = _mm512_set1_ps(q[1]), qz = _mm512_set1_ps(q[2]);
+        for (uint32_t i = 0; i < leaf.count; i += 16) {
+            __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(xs + i), qx);
+            __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(ys + i), qy);
+            __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(zs + i), qz);
+            __m512 d2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+            uint32_t mask = _mm512_cmp_ps_mask(d2, _mm512_set1_ps(rs.worstDist()), _CMP_LT_OQ);
+            if (!mask) continue;
+            alignas(64) float d[16];
+            _mm512_store_ps(d, d2);
+            for (; mask; mask &= mask - 1) {
+                int k = lowest_bit(mask);
+                if (d[k] < rs.worstDist()) rs.addPoint(d[k], leaf.right + i + k);
+            }
+        }
+#else
+#if defined(PHOTON_MAPPING_X86)
+        if (c_cpu_avx2) {
+            scan_leaf_avx2(leaf, q, rs);
+            return;
+        }
+#endif
+        const float* xs = x.data() + leaf.soa;
+        const float* ys = y.data() + leaf.soa;
+        const float* zs = z.data() + leaf.soa;
+        for (uint32_t i = 0; i < leaf.count; i++) {
+            float dx = xs[i] - q[0], dy = ys[i] - q[1], dz = zs[i] - q[2];
+            float d2 = dx * dx + dy * dy + dz * dz;
+            if (d2 < rs.worstDist()) rs.addPoint(d2, leaf.right + i);
+        }
+#endif
+    }
+    template <class RESULTSET>
+    void locate(uint32_t node, const float q[3], RESULTSET& rs) const
+    {
+        const Node& n = nodes[node];
+        if (n.axis == leaf_axis) {
+            scan_leaf(n, q, rs);
+            return;
+        }
+        float delta = q[n.axis] - n.split;
+        uint32_t near_child = delta < 0 ? node + 1 : n.right;
+        uint32_t far_child = delta < 0 ? n.right : node + 1;
+        locate(near_child, q, rs);
+        if (delta * delta < rs.worstDist()) locate(far_child, q, rs);
+    }
+public:
+    // reorder the photons in place so that every leaf is contiguous
+    void build(std::vector<Photon>& store)
+    {
+        nodes.clear();
+        x.clear(); y.clear(); z.clear();
+        if (!store.empty()) build_node(store, 0, uint32_t(store.size()));
+    }
+    // n nearest photons closer than max_dist2, as indices into the reordered store
+    void findNearestN(const float q[3], size_t n, PhotonGather& result,
+                      float max_dist2 = std::numeric_limits<float>::max()) const
+    {
+        result.reserve(n);
+        PhotonKNNHeap heap(n, max_dist2);
+        heap.init(result.indices.data(), result.dist2.data());
+        if (!nodes.empty()) locate(0, q, heap);
+        result.count = heap.size();
+        result.max_dist2 = result.count > 0 ? result.dist2[0] : 0.f;
+    }
+    // run any nanoflann-style result set over the tree
+    template <class RESULTSET>
+    void findNeighbors(RESULTSET& rs, const float q[3]) const
+    {
+        if (!nodes.empty()) locate(0, q, rs);
+    }
+    // every photon within radius of q
+    void findPhotonsWithinRadius(const float q[3], float radius, PhotonGather& result) const
+    {
+        PhotonRadiusSet rs(result, radius * radius);
+        if (!nodes.empty()) locate(0, q, rs);
+    }
+};
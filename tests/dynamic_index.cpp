@@ -0,0 +1,60 @@
+// Checks that a dynamic photon index grown by appending batches of photons
+// answers kNN and radius gathers exactly as a static index rebuilt over the
+// whole photon store, which is what PhotonMapping::add_photons relies on.
+#include "kdtree.cpp"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// sorted squared distances of a gather, the photon order within it is unspecified
+static std::vector<float> sorted_distances(const PhotonGather& gather) {
+    std::vector<float> d(gather.dist2.begin(), gather.dist2.begin() + gather.count);
+    std::sort(d.begin(), d.end());
+    return d;
+}
+
+int main() {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    auto random_photon = [&] {
+        Photon photon{};
+        for (int d = 0; d < 3; d++) photon.pos[d] = uniform(rng);
+        return photon;
+    };
+
+    std::vector<Photon> photons;
+    PhotonBounds bounds;
+    for (int i = 0; i < 20000; i++) {
+        photons.push_back(random_photon());
+        bounds.expand(photons.back());
+    }
+    DynamicPhotonKDTree dynamic_index;
+    dynamic_index.build(photons, bounds);
+
+    size_t mismatches = 0, num_queries = 0;
+    PhotonGather dynamic_gather, static_gather;
+    // uneven batches exercise merges into several trees of the forest
+    for (int batch : {1, 4095, 4096, 30000, 777}) {
+        for (int i = 0; i < batch; i++) {
+            photons.push_back(random_photon());
+            bounds.expand(photons.back());
+        }
+        dynamic_index.append(photons, bounds);
+        PhotonKDTree static_index;
+        static_index.build(photons, bounds);
+
+        for (int q = 0; q < 500; q++, num_queries++) {
+            float query[3] = {uniform(rng), uniform(rng), uniform(rng)};
+            dynamic_index.findNearestN(query, 100, dynamic_gather);
+            static_index.findNearestN(query, 100, static_gather);
+            if (sorted_distances(dynamic_gather) != sorted_distances(static_gather)) mismatches++;
+            dynamic_index.findPhotonsWithinRadius(query, 0.03f, dynamic_gather);
+            static_index.findPhotonsWithinRadius(query, 0.03f, static_gather);
+            if (sorted_distances(dynamic_gather) != sorted_distances(static_gather)) mismatches++;
+        }
+    }
+    std::cout << photons.size() << " photons, " << num_queries << " queries, "
+              << mismatches << " mismatching gathers" << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+// Checks that rendering a camera sample never touches the heap once the
+// per-thread scratch has grown. Every 16x16 tile is rendered once to warm
+// the scratch up and then again, with the same random numbers, while global
+// operator new is counted: per sample through camera_tracing, and per tile
+// through camera_hit and the Z-ordered (sorted or prefetched) gather_hits.
+// The kNN gathers run with the radius hint on, as they do by default.
+#include "parsers/parse_scene.h"
+#include "parallel.h"
+#include "photon.h"
+#include <embree4/rtcore.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+static std::atomic<size_t> num_allocations{0};
+
+void* operator new(size_t size) {
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size > 0 ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+constexpr int c_tile_size = 16;
+
+// every tile of the image through camera_tracing, then through camera_hit
+// and gather_hits. hits must have room for a tile.
+static void render_tiles(PhotonMapping& pm, const Scene& scene, std::vector<CameraHit>& hits) {
+    const int w = scene.camera.width, h = scene.camera.height;
+    const int num_tiles_x = (w + c_tile_size - 1) / c_tile_size;
+    for (int y0 = 0; y0 < h; y0 += c_tile_size) {
+        for (int x0 = 0; x0 < w; x0 += c_tile_size) {
+            int x1 = std::min(x0 + c_tile_size, w), y1 = std::min(y0 + c_tile_size, h);
+            pcg32_state rng = init_pcg32(uint64_t(y0 / c_tile_size) * num_tiles_x + x0 / c_tile_size);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) pm.camera_tracing(x, y, rng);
+            }
+            hits.clear();
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) hits.push_back(pm.camera_hit(x, y, rng));
+            }
+            pm.gather_hits(hits, rng);
+        }
+    }
+}
+
+// true when the second round over the image allocated nothing
+static bool steady_state_allocations(const Scene& scene, PhotonMappingOptions options, const char* name) {
+    PhotonMapping pm(scene, options);
+    pm.photon_tracing();
+    pm.sort_photons();
+    pm.build_kdtree();
+
+    std::vector<CameraHit> hits;
+    hits.reserve(size_t(c_tile_size) * c_tile_size);
+    render_tiles(pm, scene, hits);
+    size_t before = num_allocations.load();
+    render_tiles(pm, scene, hits);
+    size_t allocations = num_allocations.load() - before;
+
+    std::cout << name << ": " << allocations << " allocations" << std::endl;
+    return allocations == 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "[Usage] ./gather_allocations scene.xml" << std::endl;
+        return 1;
+    }
+    RTCDevice embree_device = rtcNewDevice(nullptr);
+    parallel_init(1);
+    std::unique_ptr<Scene> scene = parse_scene(argv[1], embree_device);
+
+    PhotonMappingOptions options;
+    options.num_photons = 100000;
+    options.n_neighbors = 100;
+    bool ok = true;
+    const std::pair<GatherMode, const char*> gathers[] = {
+        {GatherMode::KNearest, "knn"}, {GatherMode::Radius, "radius"}, {GatherMode::Bounded, "bounded"}};
+    const std::pair<CameraGather, const char*> cameras[] = {
+        {CameraGather::Sorted, "sorted"}, {CameraGather::Prefetch, "prefetch"}};
+    for (const auto& gather : gathers) {
+        for (const auto& camera : cameras) {
+            options.gather = gather.first;
+            options.camera_gather = camera.first;
+            std::string name = std::string(gather.second) + ", " + camera.second;
+            ok &= steady_state_allocations(*scene, options, name.c_str());
+        }
+    }
+
+    scene.reset();
+    parallel_cleanup();
+    rtcReleaseDevice(embree_device);
+    return ok ? 0 : 1;
+}
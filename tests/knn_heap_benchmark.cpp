@@ -0,0 +1,82 @@
+// Times kNN gathers through the runtime PhotonKNNHeap against FixedKNNHeap<K>
+// for the neighbour counts find_nearest specialises, over photons spread on
+// the faces of a unit box. Fails if the two heaps ever disagree; the timings
+// are only reported.
+#include "kdtree.cpp"
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using Query = std::array<float, 3>;
+
+// best of a few rounds, in seconds
+template <class GATHER>
+static double best_time(const std::vector<Query>& queries, GATHER gather) {
+    double best = std::numeric_limits<double>::max();
+    for (int round = 0; round < 5; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (const Query& q : queries) gather(q.data());
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+template <size_t K>
+static bool compare(const PhotonKDTree& index, const std::vector<Query>& queries) {
+    PhotonGather runtime, fixed;
+    size_t mismatches = 0;
+    for (const Query& q : queries) {
+        index.findNearestN(q.data(), K, runtime);
+        fixed.reserve(K);
+        FixedKNNHeap<K> heap;
+        heap.init(fixed.indices.data(), fixed.dist2.data());
+        index.findNeighbors(heap, q.data());
+        bool same = heap.size() == runtime.count;
+        for (size_t i = 0; same && i < runtime.count; i++)
+            same = fixed.indices[i] == runtime.indices[i] && fixed.dist2[i] == runtime.dist2[i];
+        if (!same) mismatches++;
+    }
+
+    double runtime_time = best_time(queries, [&](const float* q) { index.findNearestN(q, K, runtime); });
+    double fixed_time = best_time(queries, [&](const float* q) {
+        fixed.reserve(K);
+        FixedKNNHeap<K> heap;
+        heap.init(fixed.indices.data(), fixed.dist2.data());
+        index.findNeighbors(heap, q);
+    });
+    std::cout << "k = " << K << ": runtime heap " << runtime_time << " s, fixed heap " << fixed_time
+              << " s (" << runtime_time / fixed_time << "x), " << mismatches << " mismatching gathers" << std::endl;
+    return mismatches == 0;
+}
+
+int main() {
+    std::mt19937 rng(15);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    auto on_box = [&] {
+        Query p = {uniform(rng), uniform(rng), uniform(rng)};
+        int face = int(rng() % 6);
+        p[face % 3] = face < 3 ? 0.f : 1.f;
+        return p;
+    };
+
+    std::vector<Photon> photons(1000000);
+    PhotonBounds bounds;
+    for (Photon& photon : photons) {
+        Query p = on_box();
+        for (int d = 0; d < 3; d++) photon.pos[d] = p[d];
+        bounds.expand(photon);
+    }
+    PhotonKDTree index;
+    index.build(photons, bounds);
+    std::vector<Query> queries(10000);
+    for (Query& q : queries) q = on_box();
+
+    bool ok = true;
+    ok &= compare<50>(index, queries);
+    ok &= compare<100>(index, queries);
+    ok &= compare<200>(index, queries);
+    ok &= compare<500>(index, queries);
+    return ok ? 0 : 1;
+}